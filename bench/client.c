@@ -0,0 +1,249 @@
+#include "project.h"
+#include "client.h"
+
+#include <netinet/tcp.h> /* TCP_NODELAY */
+#include <stdio.h> /* sscanf(), snprintf() */
+#include <stdlib.h> /* atoll(), qsort(), realloc() */
+#include <string.h>
+#include <strings.h> /* strncasecmp() */
+#include <sys/socket.h>
+#include <time.h> /* clock_gettime() */
+#include <unistd.h> /* close() */
+
+long long bc_clock_ns(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int bc_samples_add(struct bc_samples *samples, long long value) {
+
+  long long *values;
+
+  if ( samples->count == samples->capacity ) {
+    samples->capacity = samples->capacity ? samples->capacity * 2 : 65536;
+    values = realloc(samples->values, samples->capacity * sizeof(long long));
+    if ( values == NULL )
+      return -1;
+    samples->values = values;
+  }
+  samples->values[samples->count++] = value;
+  return 0;
+}
+
+static int bc_compare(const void *a, const void *b) {
+
+  long long x, y;
+
+  x = *(const long long *)a;
+  y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+/* Move samples of all threads into one sorted set. */
+int bc_samples_merge(struct bc_samples *all, struct bc_samples *parts, int count) {
+
+  int i;
+
+  all->count = 0;
+  for ( i = 0; i < count; i++ )
+    all->count += parts[i].count;
+  all->capacity = all->count ? all->count : 1;
+  all->values = malloc(all->capacity * sizeof(long long));
+  if ( all->values == NULL )
+    return -1;
+
+  all->count = 0;
+  for ( i = 0; i < count; i++ ) {
+    memcpy(all->values + all->count, parts[i].values, parts[i].count * sizeof(long long));
+    all->count += parts[i].count;
+    free(parts[i].values);
+    parts[i].values = NULL;
+  }
+  qsort(all->values, all->count, sizeof(long long), bc_compare);
+  return 0;
+}
+
+double bc_quantile_us(const struct bc_samples *samples, double q) {
+
+  if ( samples->count == 0 )
+    return 0;
+  return samples->values[(size_t)(q * (samples->count - 1))] / 1000.0;
+}
+
+void bc_init(struct bc_conn *conn) {
+
+  conn->fd = -1;
+#ifdef USE_SSL
+  conn->s = NULL;
+#endif
+}
+
+void bc_close(struct bc_conn *conn) {
+
+#ifdef USE_SSL
+  if ( conn->s ) {
+    SSL_free(conn->s);
+    conn->s = NULL;
+  }
+#endif
+  if ( conn->fd >= 0 ) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+}
+
+/* Connect, with TLS handshake when context is given. */
+int bc_open(struct bc_conn *conn, const struct sockaddr_in *target, SSL_CTX *context, const char *servername) {
+
+  int yes;
+
+  conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if ( conn->fd < 0 )
+    return -1;
+
+  yes = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+  if ( connect(conn->fd, (const struct sockaddr *)target, sizeof(*target)) < 0 ) {
+    bc_close(conn);
+    return -1;
+  }
+
+#ifdef USE_SSL
+  if ( context ) {
+    conn->s = SSL_new(context);
+    if ( conn->s == NULL ) {
+      bc_close(conn);
+      return -1;
+    }
+    if ( servername )
+      SSL_set_tlsext_host_name(conn->s, servername);
+    SSL_set_fd(conn->s, conn->fd);
+    if ( SSL_connect(conn->s) <= 0 ) {
+      bc_close(conn);
+      return -1;
+    }
+  }
+#else
+  (void)servername;
+  if ( context ) {
+    bc_close(conn);
+    return -1;
+  }
+#endif
+
+  return 0;
+}
+
+int bc_send(struct bc_conn *conn, const char *buf, int len) {
+
+  int rv, sent;
+
+  for ( sent = 0; sent < len; sent += rv ) {
+#ifdef USE_SSL
+    if ( conn->s )
+      rv = SSL_write(conn->s, buf + sent, len - sent);
+    else
+#endif
+      rv = send(conn->fd, buf + sent, len - sent, MSG_NOSIGNAL);
+    if ( rv <= 0 )
+      return -1;
+  }
+  return 0;
+}
+
+static int bc_recv(struct bc_conn *conn, char *buf, int len) {
+
+#ifdef USE_SSL
+  if ( conn->s )
+    return SSL_read(conn->s, buf, len);
+#endif
+  return recv(conn->fd, buf, len, 0);
+}
+
+/*
+Read one response into buf, the body is read and dropped. head tells that the
+request was HEAD, keepalive that the connection may be reused. Returns 0, or
+-1 on error.
+*/
+int bc_response(struct bc_conn *conn, char *buf, int size, int head, int keepalive, struct bc_response *response) {
+
+  char *end, *line, *value;
+  int have, rv, header_length;
+  long long content_length, body;
+  size_t len;
+
+  response->status = -1;
+  response->content_type[0] = 0;
+  response->reuse = 0;
+
+  have = 0;
+  end = NULL;
+  while ( end == NULL ) {
+    if ( have >= size - 1 )
+      return -1;
+    rv = bc_recv(conn, buf + have, size - 1 - have);
+    if ( rv <= 0 )
+      return -1;
+    have += rv;
+    buf[have] = 0;
+    end = strstr(buf, "\r\n\r\n");
+  }
+
+  if ( sscanf(buf, "HTTP/%*d.%*d %d", &response->status) != 1 )
+    return -1;
+
+  header_length = end + 4 - buf;
+  content_length = -1;
+  response->reuse = keepalive && !strncmp(buf, "HTTP/1.1", 8);
+  for ( line = strstr(buf, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n") ) {
+    if ( !strncasecmp(line + 2, "Content-Length:", 15) )
+      content_length = atoll(line + 17);
+    else if ( !strncasecmp(line + 2, "Connection: close", 17) )
+      response->reuse = 0;
+    else if ( !strncasecmp(line + 2, "Content-Type:", 13) ) {
+      value = line + 15;
+      while ( *value == ' ' )
+        value++;
+      len = strcspn(value, ";\r");
+      if ( len >= sizeof(response->content_type) )
+        len = sizeof(response->content_type) - 1;
+      memcpy(response->content_type, value, len);
+      response->content_type[len] = 0;
+    }
+  }
+
+  /* Drain body, it is either sized or ends with the connection. */
+  body = have - header_length;
+  if ( head || response->status == 204 || response->status == 304 )
+    content_length = 0;
+  while ( content_length < 0 || body < content_length ) {
+    rv = bc_recv(conn, buf, size);
+    if ( rv < 0 )
+      return -1;
+    if ( rv == 0 ) {
+      if ( content_length >= 0 )
+        return -1;
+      break;
+    }
+    body += rv;
+  }
+  if ( content_length < 0 )
+    response->reuse = 0;
+
+  return 0;
+}
+
+/* Client context without certificate verification, the server is our own. */
+SSL_CTX *bc_ssl_context(void) {
+
+#ifdef USE_SSL
+  return SSL_CTX_new(TLS_client_method());
+#else
+  fprintf(stderr, "ERROR: TLS needs a build with USE_SSL.\n");
+  return NULL;
+#endif
+}
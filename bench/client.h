@@ -0,0 +1,47 @@
+#ifndef _TINYSRV_BENCH_CLIENT_H
+#define _TINYSRV_BENCH_CLIENT_H
+
+#include <netinet/in.h> /* struct sockaddr_in */
+#include <stddef.h> /* size_t */
+
+#ifdef USE_SSL
+ #include <openssl/ssl.h>
+#else
+ typedef struct ssl_ctx_st SSL_CTX;
+#endif
+
+/* Blocking HTTP/1.x client connection shared by the benchmark tools. */
+struct bc_conn {
+  int fd;
+#ifdef USE_SSL
+  SSL *s;
+#endif
+};
+
+/* What was read of one response. */
+struct bc_response {
+  int status;
+  char content_type[64];
+  /* Connection may carry another request. */
+  int reuse;
+};
+
+/* Latency samples in nanoseconds. */
+struct bc_samples {
+  long long *values;
+  size_t count;
+  size_t capacity;
+};
+
+long long bc_clock_ns(void);
+int bc_samples_add(struct bc_samples *, long long);
+int bc_samples_merge(struct bc_samples *, struct bc_samples *, int);
+double bc_quantile_us(const struct bc_samples *, double);
+void bc_init(struct bc_conn *);
+int bc_open(struct bc_conn *, const struct sockaddr_in *, SSL_CTX *, const char *);
+void bc_close(struct bc_conn *);
+int bc_send(struct bc_conn *, const char *, int);
+int bc_response(struct bc_conn *, char *, int, int, int, struct bc_response *);
+SSL_CTX *bc_ssl_context(void);
+
+#endif
@@ -0,0 +1,342 @@
+#include "project.h"
+#include "client.h"
+
+#include <arpa/inet.h> /* inet_pton() */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h> /* atoi(), qsort(), realloc() */
+#include <string.h>
+#include <sys/resource.h> /* getrusage() */
+#include <unistd.h> /* sysconf() */
+
+#define LG_REQUEST_SIZE 4096
+#define LG_MAX_PIDS 64
+
+/* One request template read from a scenario file. */
+struct lg_scenario {
+  char name[64];
+  int tls;
+  char host[256];
+  char request[LG_REQUEST_SIZE];
+  int request_length;
+  int expect;
+};
+
+struct lg_thread {
+  pthread_t thread;
+  struct bc_samples *samples;
+  unsigned long long errors;
+  char buffer[CHAR_BUF_SIZE];
+};
+
+static struct lg_scenario scenario;
+static struct sockaddr_in target;
+static int keepalive;
+static long long deadline;
+static long long remaining;
+static SSL_CTX *ssl_context;
+
+static void usage(void) {
+
+  fprintf(stderr,
+    "Usage: loadgen -s scenario [-a address] [-p port] [-k port] [-c concurrency]\n"
+    "               [-d seconds] [-n requests] [-K] [-P pid,...] [-H]\n"
+    "  -s scenario     scenario file\n"
+    "  -a address      server address (default 127.0.0.1)\n"
+    "  -p port         plain HTTP port (default 8080)\n"
+    "  -k port         HTTPS port for tls scenarios (default 8443)\n"
+    "  -c concurrency  number of client threads (default 4)\n"
+    "  -d seconds      duration of the run (default 5)\n"
+    "  -n requests     stop after given number of requests\n"
+    "  -K              ask for keep-alive and reuse connections the server keeps open\n"
+    "  -P pid,...      server processes whose CPU time is measured\n"
+    "  -H              print CSV header and exit\n");
+}
+
+/* Read scenario file with "key value" lines and build the request. */
+static int lg_scenario_load(struct lg_scenario *sc, const char *path) {
+
+  FILE *f;
+  char line[1024], method[16], path_[1024], headers[2048], body[1024];
+  char *value;
+  size_t len;
+  int hlen;
+
+  f = fopen(path, "r");
+  if ( f == NULL ) {
+    fprintf(stderr, "ERROR: Scenario %s could not be opened: %s.\n", path, strerror(errno));
+    return -1;
+  }
+
+  memset(sc, 0, sizeof(*sc));
+  strcpy(method, "GET");
+  strcpy(path_, "/");
+  strcpy(sc->host, "localhost");
+  headers[0] = 0;
+  body[0] = 0;
+  hlen = 0;
+  sc->expect = 200;
+
+  while ( fgets(line, sizeof(line), f) ) {
+
+    len = strlen(line);
+    while ( len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r') )
+      line[--len] = 0;
+    if ( len == 0 || line[0] == '#' )
+      continue;
+
+    value = strchr(line, ' ');
+    if ( value == NULL )
+      value = line + len;
+    else
+      *value++ = 0;
+
+    if ( !strcmp(line, "name") )
+      snprintf(sc->name, sizeof(sc->name), "%s", value);
+    else if ( !strcmp(line, "tls") )
+      sc->tls = atoi(value);
+    else if ( !strcmp(line, "host") )
+      snprintf(sc->host, sizeof(sc->host), "%s", value);
+    else if ( !strcmp(line, "method") )
+      snprintf(method, sizeof(method), "%s", value);
+    else if ( !strcmp(line, "path") )
+      snprintf(path_, sizeof(path_), "%s", value);
+    else if ( !strcmp(line, "header") )
+      hlen += snprintf(headers + hlen, sizeof(headers) - hlen, "%s\r\n", value);
+    else if ( !strcmp(line, "body") )
+      snprintf(body, sizeof(body), "%s", value);
+    else if ( !strcmp(line, "expect") )
+      sc->expect = atoi(value);
+    else {
+      fprintf(stderr, "ERROR: Unknown key %s in scenario %s.\n", line, path);
+      fclose(f);
+      return -1;
+    }
+
+    if ( hlen >= (int)sizeof(headers) ) {
+      fprintf(stderr, "ERROR: Too many headers in scenario %s.\n", path);
+      fclose(f);
+      return -1;
+    }
+  }
+  fclose(f);
+
+  if ( sc->name[0] == 0 )
+    snprintf(sc->name, sizeof(sc->name), "%s", path);
+
+  if ( body[0] )
+    hlen += snprintf(headers + hlen, sizeof(headers) - hlen, "Content-Length: %zu\r\n", strlen(body));
+
+  sc->request_length = snprintf(sc->request, sizeof(sc->request),
+    "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n%s\r\n%s",
+    method, path_, sc->host, keepalive ? "keep-alive" : "close", headers, body);
+  if ( sc->request_length >= (int)sizeof(sc->request) ) {
+    fprintf(stderr, "ERROR: Request of scenario %s is too long.\n", path);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void *lg_thread_run(void *arg) {
+
+  struct lg_thread *t;
+  struct bc_conn conn;
+  struct bc_response response;
+  long long start;
+  int head;
+
+  t = (struct lg_thread *)arg;
+  bc_init(&conn);
+  head = !strncmp(scenario.request, "HEAD ", 5);
+
+  for (;;) {
+
+    if ( remaining >= 0 && __atomic_sub_fetch(&remaining, 1, __ATOMIC_RELAXED) < 0 )
+      break;
+
+    start = bc_clock_ns();
+    if ( start >= deadline )
+      break;
+
+    response.status = -1;
+    response.reuse = 0;
+    if ( conn.fd >= 0 || bc_open(&conn, &target, ssl_context, scenario.host) == 0 ) {
+      if ( bc_send(&conn, scenario.request, scenario.request_length) == 0 )
+        bc_response(&conn, t->buffer, sizeof(t->buffer), head, keepalive, &response);
+    }
+    if ( !response.reuse )
+      bc_close(&conn);
+
+    if ( response.status != scenario.expect || bc_samples_add(t->samples, bc_clock_ns() - start) < 0 )
+      t->errors++;
+  }
+
+  bc_close(&conn);
+  return NULL;
+}
+
+/* User and system time of process in microseconds. */
+static long long lg_process_cpu(long pid) {
+
+  char path[64], line[1024], *p;
+  unsigned long long utime, stime;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+  f = fopen(path, "r");
+  if ( f == NULL )
+    return 0;
+  p = fgets(line, sizeof(line), f);
+  fclose(f);
+  if ( p == NULL || (p = strrchr(line, ')')) == NULL )
+    return 0;
+  if ( sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2 )
+    return 0;
+  return (long long)(utime + stime) * 1000000LL / sysconf(_SC_CLK_TCK);
+}
+
+static long long lg_server_cpu(const long *pids, int count) {
+
+  long long total;
+  int i;
+
+  total = 0;
+  for ( i = 0; i < count; i++ )
+    total += lg_process_cpu(pids[i]);
+  return total;
+}
+
+static long long lg_self_cpu(void) {
+
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+int main(int argc, char **argv) {
+
+  struct lg_thread *threads;
+  const char *scenario_path, *address;
+  long pids[LG_MAX_PIDS];
+  int port, tls_port, concurrency, duration, pid_count, i;
+  long long started, elapsed, client_cpu, server_cpu;
+  struct bc_samples *parts, samples;
+  unsigned long long errors;
+  char *p;
+
+  scenario_path = NULL;
+  address = "127.0.0.1";
+  port = 8080;
+  tls_port = 8443;
+  concurrency = 4;
+  duration = 5;
+  remaining = -1;
+  pid_count = 0;
+
+  for ( i = 1; i < argc; i++ ) {
+    if ( argv[i][0] != '-' ) {
+      usage();
+      return EXIT_FAILURE;
+    }
+    switch ( argv[i][1] ) {
+      case 'H':
+        printf("scenario,keepalive,concurrency,requests,errors,seconds,rps,p50_us,p99_us,p999_us,client_cpu_us_per_req,server_cpu_us_per_req\n");
+        return 0;
+      case 'K':
+        keepalive = 1; continue;
+    }
+    if ( i + 1 >= argc ) {
+      usage();
+      return EXIT_FAILURE;
+    }
+    switch ( argv[i++][1] ) {
+      case 's': scenario_path = argv[i]; break;
+      case 'a': address = argv[i]; break;
+      case 'p': port = atoi(argv[i]); break;
+      case 'k': tls_port = atoi(argv[i]); break;
+      case 'c': concurrency = atoi(argv[i]); break;
+      case 'd': duration = atoi(argv[i]); break;
+      case 'n': remaining = atoll(argv[i]); break;
+      case 'P':
+        for ( p = argv[i]; *p && pid_count < LG_MAX_PIDS; ) {
+          pids[pid_count++] = strtol(p, &p, 10);
+          if ( *p == ',' )
+            p++;
+        }
+        break;
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+
+  if ( scenario_path == NULL || concurrency <= 0 || duration <= 0 ) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  if ( lg_scenario_load(&scenario, scenario_path) < 0 )
+    return EXIT_FAILURE;
+
+  memset(&target, 0, sizeof(target));
+  target.sin_family = AF_INET;
+  target.sin_port = htons(scenario.tls ? tls_port : port);
+  if ( inet_pton(AF_INET, address, &target.sin_addr) != 1 ) {
+    fprintf(stderr, "ERROR: Invalid address %s.\n", address);
+    return EXIT_FAILURE;
+  }
+
+  if ( scenario.tls ) {
+    ssl_context = bc_ssl_context();
+    if ( ssl_context == NULL )
+      return EXIT_FAILURE;
+  }
+
+  threads = calloc(concurrency, sizeof(struct lg_thread));
+  parts = calloc(concurrency, sizeof(struct bc_samples));
+  if ( threads == NULL || parts == NULL )
+    return EXIT_FAILURE;
+  for ( i = 0; i < concurrency; i++ )
+    threads[i].samples = &parts[i];
+
+  client_cpu = lg_self_cpu();
+  server_cpu = lg_server_cpu(pids, pid_count);
+  started = bc_clock_ns();
+  deadline = started + duration * 1000000000LL;
+
+  for ( i = 0; i < concurrency; i++ ) {
+    if ( pthread_create(&threads[i].thread, NULL, lg_thread_run, &threads[i]) != 0 ) {
+      fprintf(stderr, "ERROR: Thread could not be created.\n");
+      return EXIT_FAILURE;
+    }
+  }
+  for ( i = 0; i < concurrency; i++ )
+    pthread_join(threads[i].thread, NULL);
+
+  elapsed = bc_clock_ns() - started;
+  client_cpu = lg_self_cpu() - client_cpu;
+  server_cpu = lg_server_cpu(pids, pid_count) - server_cpu;
+
+  errors = 0;
+  for ( i = 0; i < concurrency; i++ )
+    errors += threads[i].errors;
+  if ( bc_samples_merge(&samples, parts, concurrency) < 0 )
+    return EXIT_FAILURE;
+
+  printf("%s,%d,%d,%zu,%llu,%.3f,%.1f,%.1f,%.1f,%.1f,%.2f,%.2f\n",
+    scenario.name, keepalive, concurrency, samples.count, errors, elapsed / 1e9,
+    samples.count / (elapsed / 1e9),
+    bc_quantile_us(&samples, 0.5),
+    bc_quantile_us(&samples, 0.99),
+    bc_quantile_us(&samples, 0.999),
+    samples.count ? (double)client_cpu / samples.count : 0.0,
+    samples.count ? (double)server_cpu / samples.count : 0.0);
+
+  free(samples.values);
+  free(parts);
+  free(threads);
+  return errors && samples.count == 0 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,426 @@
+#include "project.h"
+#include "arena.h"
+#include "http.h"
+#include "mime.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h> /* atoi(), malloc() */
+#include <string.h>
+#include <time.h> /* clock_gettime() */
+
+#if defined(__x86_64__) || defined(__i386__)
+ #include <x86intrin.h> /* __rdtsc() */
+ #define MB_CYCLES() __rdtsc()
+#else
+ #define MB_CYCLES() 0ULL
+#endif
+
+/* Times every benchmark pass runs through its corpus. */
+#define MB_INNER 64
+#define MB_MAX_ITEMS 256
+#define MB_BUFFER_SIZE 4096
+
+/* Objects of src/ refer to the flag of the main program. */
+volatile int terminated;
+
+struct mb_corpus {
+  /* Raw request headers with CRLF line ends. */
+  char *requests[MB_MAX_ITEMS];
+  int request_count;
+  /* Request targets as they appear in the request line. */
+  char *urls[MB_MAX_ITEMS];
+  int url_count;
+  /* Paths without query, and their extensions. */
+  char *paths[MB_MAX_ITEMS];
+  char *exts[MB_MAX_ITEMS];
+  /* Host header values. */
+  char *hosts[MB_MAX_ITEMS];
+  int host_count;
+};
+
+static struct mb_corpus corpus;
+static ts_arena_t arena;
+static ts_arena_t response_arena;
+static ps_http_request_header_t parsed[MB_MAX_ITEMS];
+static ps_http_response_header_t response;
+static char hosts_work[MB_INNER][MB_MAX_ITEMS][256];
+static char buffer[MB_BUFFER_SIZE];
+
+/* Keeps results alive, so the compiler can not drop the calls. */
+static volatile unsigned long sink;
+
+static long long mb_clock_ns(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static char *mb_read_file(const char *dir, const char *name) {
+
+  char path[MAX_PATH_LENGTH];
+  FILE *f;
+  char *data;
+  long size;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  f = fopen(path, "r");
+  if ( f == NULL ) {
+    fprintf(stderr, "ERROR: Corpus file %s could not be opened: %s.\n", path, strerror(errno));
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  rewind(f);
+  data = malloc(size + 1);
+  if ( data && fread(data, 1, size, f) != (size_t)size ) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  if ( data )
+    data[size] = 0;
+  return data;
+}
+
+/* Requests are separated by lines with "%%", line ends are turned into CRLF. */
+static int mb_load_requests(const char *dir) {
+
+  char *data, *line, *next, *req, *host;
+  size_t len;
+
+  data = mb_read_file(dir, "requests.txt");
+  if ( data == NULL )
+    return -1;
+
+  req = NULL;
+  len = 0;
+  for ( line = data; line && *line; line = next ) {
+
+    next = strchr(line, '\n');
+    if ( next )
+      *next++ = 0;
+
+    if ( req == NULL ) {
+      req = malloc(MB_BUFFER_SIZE);
+      if ( req == NULL )
+        return -1;
+      len = 0;
+    }
+
+    if ( strcmp(line, "%%") ) {
+      if ( !strncmp(line, "Host: ", 6) && corpus.host_count < MB_MAX_ITEMS ) {
+        host = strdup(line + 6);
+        if ( host == NULL )
+          return -1;
+        corpus.hosts[corpus.host_count++] = host;
+      }
+      len += snprintf(req + len, MB_BUFFER_SIZE - len, "%s\r\n", line);
+      if ( len < MB_BUFFER_SIZE - 3 && next && *next )
+        continue;
+    }
+
+    if ( corpus.request_count == MB_MAX_ITEMS || len >= MB_BUFFER_SIZE - 3 ) {
+      fprintf(stderr, "ERROR: Too many or too long requests in corpus.\n");
+      return -1;
+    }
+    strcpy(req + len, "\r\n");
+    corpus.requests[corpus.request_count++] = req;
+    req = NULL;
+  }
+
+  free(data);
+  return corpus.request_count > 0 ? 0 : -1;
+}
+
+static int mb_load_urls(const char *dir) {
+
+  char *data, *line, *next, *path;
+
+  data = mb_read_file(dir, "urls.txt");
+  if ( data == NULL )
+    return -1;
+
+  for ( line = data; line && *line; line = next ) {
+
+    next = strchr(line, '\n');
+    if ( next )
+      *next++ = 0;
+    if ( *line == 0 || *line == '#' )
+      continue;
+
+    if ( corpus.url_count == MB_MAX_ITEMS ) {
+      fprintf(stderr, "ERROR: Too many URLs in corpus.\n");
+      return -1;
+    }
+
+    path = strdup(line);
+    if ( path == NULL )
+      return -1;
+    path[strcspn(path, "?#;=")] = 0;
+    corpus.urls[corpus.url_count] = line;
+    corpus.paths[corpus.url_count] = path;
+    corpus.exts[corpus.url_count] = strrchr(path, '.');
+    corpus.url_count++;
+  }
+
+  /* URL strings point into data, which is kept. */
+  return corpus.url_count > 0 ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void prepare_arena(void) {
+
+  ts_arena_reset(&arena);
+}
+
+static void prepare_hosts(void) {
+
+  int i, j;
+
+  for ( j = 0; j < MB_INNER; j++ )
+    for ( i = 0; i < corpus.host_count; i++ )
+      snprintf(hosts_work[j][i], sizeof(hosts_work[j][i]), "%s", corpus.hosts[i]);
+}
+
+static unsigned long run_http_header_parse(void) {
+
+  ps_http_request_header_t header;
+  unsigned long sum;
+  int i, j, error;
+
+  sum = 0;
+  header.arena = &arena;
+  for ( j = 0; j < MB_INNER; j++ )
+    for ( i = 0; i < corpus.request_count; i++ ) {
+      http_header_parse(&header, corpus.requests[i], &error);
+      sum += error + header.method;
+    }
+  return sum;
+}
+
+static unsigned long run_http_header_getvalue(void) {
+
+  unsigned long sum;
+  char *value;
+  int i, j;
+
+  sum = 0;
+  for ( j = 0; j < MB_INNER; j++ )
+    for ( i = 0; i < corpus.request_count; i++ ) {
+      if ( parsed[i].header_start == NULL )
+        continue;
+      value = http_header_getvalue(&parsed[i], HEADER_HOSTNAME);
+      sum += (unsigned long)value;
+      value = http_header_getvalue(&parsed[i], HEADER_ACCEPT);
+      sum += (unsigned long)value;
+      value = http_header_getvalue(&parsed[i], HEADER_REFERER);
+      sum += (unsigned long)value;
+    }
+  return sum;
+}
+
+static unsigned long run_get_mime(void) {
+
+  unsigned long sum;
+  int i, j;
+
+  sum = 0;
+  for ( j = 0; j < MB_INNER; j++ )
+    for ( i = 0; i < corpus.url_count; i++ )
+      sum += get_mime(corpus.exts[i])->response_type;
+  return sum;
+}
+
+static unsigned long run_decode_url(void) {
+
+  unsigned long sum;
+  int i, j;
+
+  sum = 0;
+  for ( j = 0; j < MB_INNER; j++ )
+    for ( i = 0; i < corpus.url_count; i++ ) {
+      decode_url(buffer, corpus.urls[i]);
+      sum += buffer[0];
+    }
+  return sum;
+}
+
+static unsigned long run_strstr_last(void) {
+
+  unsigned long sum;
+  int i, j;
+
+  sum = 0;
+  for ( j = 0; j < MB_INNER; j++ )
+    for ( i = 0; i < corpus.url_count; i++ )
+      sum += (unsigned long)strstr_last(corpus.urls[i], "http");
+  return sum;
+}
+
+static unsigned long run_is_safe_filename(void) {
+
+  unsigned long sum;
+  int i, j;
+
+  sum = 0;
+  for ( j = 0; j < MB_INNER; j++ )
+    for ( i = 0; i < corpus.url_count; i++ )
+      sum += is_safe_filename(corpus.paths[i]);
+  return sum;
+}
+
+static unsigned long run_change_dots_to_underscore(void) {
+
+  unsigned long sum;
+  int i, j;
+
+  sum = 0;
+  for ( j = 0; j < MB_INNER; j++ )
+    for ( i = 0; i < corpus.host_count; i++ )
+      sum += change_dots_to_underscore(hosts_work[j][i]);
+  return sum;
+}
+
+static unsigned long run_http_header_fill(void) {
+
+  unsigned long sum;
+  int i, j;
+
+  sum = 0;
+  for ( j = 0; j < MB_INNER; j++ )
+    for ( i = 0; i < corpus.request_count; i++ )
+      sum += http_header_fill(&response, buffer, sizeof(buffer) - 1);
+  return sum;
+}
+
+/* ------------------------------------------------------------------------- */
+
+struct mb_bench {
+  const char *name;
+  /* Untimed setup before every round. */
+  void (*prepare)(void);
+  unsigned long (*run)(void);
+  /* Corpus items of one pass and calls made per item. */
+  const int *items;
+  int calls;
+};
+
+static const struct mb_bench benches[] = {
+  { "http_header_parse", prepare_arena, run_http_header_parse, &corpus.request_count, 1 },
+  { "http_header_getvalue", prepare_arena, run_http_header_getvalue, &corpus.request_count, 3 },
+  { "get_mime", NULL, run_get_mime, &corpus.url_count, 1 },
+  { "decode_url", NULL, run_decode_url, &corpus.url_count, 1 },
+  { "strstr_last", NULL, run_strstr_last, &corpus.url_count, 1 },
+  { "is_safe_filename", NULL, run_is_safe_filename, &corpus.url_count, 1 },
+  { "change_dots_to_underscore", prepare_hosts, run_change_dots_to_underscore, &corpus.host_count, 1 },
+  { "http_header_fill", NULL, run_http_header_fill, &corpus.request_count, 1 },
+  { NULL, NULL, NULL, NULL, 0 }
+};
+
+/* Best of all rounds is reported, it is the least disturbed by the system. */
+static void mb_run(const struct mb_bench *bench, int rounds) {
+
+  long long ns, best_ns;
+  unsigned long long cycles, best_cycles;
+  double ops;
+  int r;
+
+  best_ns = -1;
+  best_cycles = 0;
+  for ( r = 0; r < rounds; r++ ) {
+    if ( bench->prepare )
+      bench->prepare();
+    ns = mb_clock_ns();
+    cycles = MB_CYCLES();
+    sink += bench->run();
+    cycles = MB_CYCLES() - cycles;
+    ns = mb_clock_ns() - ns;
+    if ( best_ns < 0 || ns < best_ns ) {
+      best_ns = ns;
+      best_cycles = cycles;
+    }
+  }
+
+  ops = (double)MB_INNER * *bench->items * bench->calls;
+  printf("%-28s %12.0f %10.1f %10.1f\n", bench->name, ops * rounds, best_ns / ops, best_cycles / ops);
+}
+
+static void usage(void) {
+
+  fprintf(stderr,
+    "Usage: microbench [-c corpus] [-r rounds] [name ...]\n"
+    "  -c corpus  directory with requests.txt and urls.txt (default bench/corpus)\n"
+    "  -r rounds  timed rounds of every benchmark (default 200)\n");
+}
+
+int main(int argc, char **argv) {
+
+  const struct mb_bench *bench;
+  const char *dir;
+  int rounds, i, j, error, selected;
+
+  dir = "bench/corpus";
+  rounds = 200;
+  for ( i = 1; i < argc && argv[i][0] == '-'; i++ ) {
+    if ( i + 1 >= argc ) {
+      usage();
+      return EXIT_FAILURE;
+    }
+    switch ( argv[i++][1] ) {
+      case 'c': dir = argv[i]; break;
+      case 'r': rounds = atoi(argv[i]); break;
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+  if ( rounds <= 0 ) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  if ( ts_arena_init(&arena) < 0 || mb_load_requests(dir) < 0 || mb_load_urls(dir) < 0 )
+    return EXIT_FAILURE;
+
+  /*
+  Headers for getvalue are parsed once. Only header_start is used later, it
+  points into the corpus, so the arena may be reset between rounds.
+  */
+  for ( j = 0; j < corpus.request_count; j++ ) {
+    parsed[j].arena = &arena;
+    parsed[j].header_start = NULL;
+    http_header_parse(&parsed[j], corpus.requests[j], &error);
+    if ( error )
+      parsed[j].header_start = NULL;
+  }
+
+  /* Typical response of a dummy image. */
+  if ( ts_arena_init(&response_arena) < 0 )
+    return EXIT_FAILURE;
+  response.arena = &response_arena;
+  response.version = HTTP_VERSION_10;
+  response.status_code = 200;
+  memset(&response.field, 0, sizeof(response.field));
+  http_header_setvalue(&response, HEADER_CONTENT_TYPE, "image/gif");
+  http_header_setvalue(&response, HEADER_CONTENT_LENGTH, "42");
+  http_header_setvalue(&response, HEADER_CONNECTION, "close");
+
+  printf("%d requests, %d URLs, %d hosts, %d rounds\n", corpus.request_count, corpus.url_count, corpus.host_count, rounds);
+  printf("%-28s %12s %10s %10s\n", "function", "calls", "ns/call", "cycles/call");
+
+  for ( bench = benches; bench->name; bench++ ) {
+    selected = ( i == argc );
+    for ( j = i; j < argc; j++ )
+      if ( !strcmp(argv[j], bench->name) )
+        selected = 1;
+    if ( selected )
+      mb_run(bench, rounds);
+  }
+
+  return 0;
+}
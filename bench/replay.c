@@ -0,0 +1,422 @@
+#include "project.h"
+#include "client.h"
+
+#include <arpa/inet.h> /* inet_pton() */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h> /* atoi(), strtod() */
+#include <string.h>
+#include <time.h> /* clock_nanosleep() */
+
+/*
+Capture file holds one record per request:
+
+  <tls> <servername|-> <status|0> <content-type|-> <length>\n
+  <length bytes of raw request>\n
+
+Lines starting with # between records are comments. Status 0 and content
+type - are not checked.
+*/
+
+#define RP_MAX_MISMATCHES 10
+
+struct rp_record {
+  int tls;
+  char servername[256];
+  int status;
+  char content_type[64];
+  char *request;
+  int length;
+};
+
+struct rp_thread {
+  pthread_t thread;
+  struct bc_samples *samples;
+  unsigned long long errors;
+  unsigned long long mismatches;
+  char buffer[CHAR_BUF_SIZE];
+};
+
+static struct rp_record *records;
+static int record_count;
+static struct sockaddr_in plain_target, tls_target;
+static SSL_CTX *ssl_context;
+static double rate;
+static long long total;
+static long long next_index;
+static long long started;
+static int reported;
+
+static void usage(void) {
+
+  fprintf(stderr,
+    "Usage: replay -f capture [-a address] [-p port] [-k port] [-c concurrency]\n"
+    "              [-r rate] [-n loops]\n"
+    "       replay -I access.log [-H host] [-T] [-N]\n"
+    "  -f capture      capture file to replay\n"
+    "  -a address      server address (default 127.0.0.1)\n"
+    "  -p port         plain HTTP port (default 8080)\n"
+    "  -k port         HTTPS port (default 8443)\n"
+    "  -c concurrency  number of client threads (default 4)\n"
+    "  -r rate         requests per second, 0 replays as fast as possible (default 0)\n"
+    "  -n loops        times the capture is replayed (default 1)\n"
+    "  -I access.log   convert common, combined or vhost_combined log to capture on stdout\n"
+    "  -H host         host of requests without virtual host in log (default localhost)\n"
+    "  -T              requests are sent over TLS with host as servername\n"
+    "  -N              do not expect status from log\n");
+}
+
+static int rp_load(const char *path) {
+
+  FILE *f;
+  char line[1024], servername[256], content_type[64];
+  struct rp_record *record;
+  int capacity, tls, status, length;
+
+  f = fopen(path, "r");
+  if ( f == NULL ) {
+    fprintf(stderr, "ERROR: Capture %s could not be opened: %s.\n", path, strerror(errno));
+    return -1;
+  }
+
+  capacity = 0;
+  while ( fgets(line, sizeof(line), f) ) {
+
+    if ( line[0] == '#' || line[0] == '\n' )
+      continue;
+
+    if ( sscanf(line, "%d %255s %d %63s %d", &tls, servername, &status, content_type, &length) != 5 || length <= 0 ) {
+      fprintf(stderr, "ERROR: Invalid record %d in capture %s.\n", record_count + 1, path);
+      fclose(f);
+      return -1;
+    }
+
+    if ( record_count == capacity ) {
+      capacity = capacity ? capacity * 2 : 1024;
+      record = realloc(records, capacity * sizeof(struct rp_record));
+      if ( record == NULL ) {
+        fclose(f);
+        return -1;
+      }
+      records = record;
+    }
+
+    record = &records[record_count];
+    record->tls = tls;
+    strcpy(record->servername, servername);
+    record->status = status;
+    strcpy(record->content_type, content_type);
+    record->length = length;
+    record->request = malloc(length);
+    if ( record->request == NULL || fread(record->request, 1, length, f) != (size_t)length ) {
+      fprintf(stderr, "ERROR: Truncated record %d in capture %s.\n", record_count + 1, path);
+      fclose(f);
+      return -1;
+    }
+    record_count++;
+  }
+
+  fclose(f);
+  return record_count > 0 ? 0 : -1;
+}
+
+/* Wait until absolute monotonic time in nanoseconds. */
+static void rp_sleep_until(long long ns) {
+
+  struct timespec ts;
+
+  ts.tv_sec = ns / 1000000000LL;
+  ts.tv_nsec = ns % 1000000000LL;
+  while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR );
+}
+
+static void *rp_thread_run(void *arg) {
+
+  struct rp_thread *t;
+  struct rp_record *record;
+  struct bc_conn conn;
+  struct bc_response response;
+  const char *type;
+  long long index, start;
+  int failed;
+
+  t = (struct rp_thread *)arg;
+  bc_init(&conn);
+
+  for (;;) {
+
+    index = __atomic_fetch_add(&next_index, 1, __ATOMIC_RELAXED);
+    if ( index >= total )
+      break;
+    record = &records[index % record_count];
+
+    /*
+    With a fixed rate, latency counts from the time the request was due, so a
+    slow server is not hidden by requests that are sent late.
+    */
+    if ( rate > 0 ) {
+      start = started + (long long)(index * 1e9 / rate);
+      rp_sleep_until(start);
+    }
+    else
+      start = bc_clock_ns();
+
+    /* Captured requests are independent, every one gets its own connection. */
+    failed = bc_open(&conn, record->tls ? &tls_target : &plain_target,
+      record->tls ? ssl_context : NULL, record->servername[0] == '-' ? NULL : record->servername) < 0;
+    if ( !failed )
+      failed = bc_send(&conn, record->request, record->length) < 0 ||
+        bc_response(&conn, t->buffer, sizeof(t->buffer), !strncmp(record->request, "HEAD ", 5), 0, &response) < 0;
+    bc_close(&conn);
+
+    if ( failed ) {
+      t->errors++;
+      continue;
+    }
+
+    if ( bc_samples_add(t->samples, bc_clock_ns() - start) < 0 )
+      t->errors++;
+
+    if ( (record->status && record->status != response.status) ||
+         (record->content_type[0] != '-' && strcmp(record->content_type, response.content_type)) ) {
+      t->mismatches++;
+      if ( __atomic_fetch_add(&reported, 1, __ATOMIC_RELAXED) < RP_MAX_MISMATCHES ) {
+        type = response.content_type[0] ? response.content_type : "-";
+        fprintf(stderr, "mismatch in record %lld: expected %d %s, got %d %s\n",
+          index % record_count + 1, record->status, record->content_type, response.status, type);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Copy next field delimited by space, or by quotes when it starts with one. */
+static char *rp_field(char **str, char *out, size_t size) {
+
+  char *s, *end;
+  size_t len;
+
+  s = *str;
+  while ( *s == ' ' )
+    s++;
+  if ( *s == 0 || *s == '\n' )
+    return NULL;
+
+  if ( *s == '"' ) {
+    s++;
+    for ( end = s; *end && *end != '"'; end++ )
+      if ( *end == '\\' && end[1] )
+        end++;
+    len = end - s;
+    *str = *end ? end + 1 : end;
+  }
+  else if ( *s == '[' ) {
+    end = strchr(s, ']');
+    if ( end == NULL )
+      return NULL;
+    len = end - s + 1;
+    *str = end + 1;
+  }
+  else {
+    end = s + strcspn(s, " \n");
+    len = end - s;
+    *str = end;
+  }
+
+  if ( len >= size )
+    len = size - 1;
+  memcpy(out, s, len);
+  out[len] = 0;
+  return out;
+}
+
+/* Log format is told apart by the number of fields before the timestamp. */
+static int rp_import(const char *path, const char *default_host, int tls, int expect) {
+
+  FILE *f;
+  char line[8192], fields[5][256], request_line[4096], referer[2048], agent[1024];
+  char request[CHAR_BUF_SIZE], method[16], target[4096], *str, *host, *colon;
+  int count, status, length, lines, imported;
+
+  f = fopen(path, "r");
+  if ( f == NULL ) {
+    fprintf(stderr, "ERROR: Log %s could not be opened: %s.\n", path, strerror(errno));
+    return -1;
+  }
+
+  lines = imported = 0;
+  while ( fgets(line, sizeof(line), f) ) {
+
+    lines++;
+    str = line;
+    for ( count = 0; count < 5; count++ ) {
+      if ( rp_field(&str, fields[count], sizeof(fields[count])) == NULL )
+        break;
+      if ( fields[count][0] == '[' )
+        break;
+    }
+    /* common: ip ident user [time], vhost_combined: vhost:port ip ident user [time] */
+    if ( count != 3 && count != 4 )
+      continue;
+    host = ( count == 4 ) ? fields[0] : (char *)default_host;
+    if ( count == 4 && (colon = strrchr(host, ':')) != NULL )
+      *colon = 0;
+
+    if ( rp_field(&str, request_line, sizeof(request_line)) == NULL ||
+         sscanf(request_line, "%15s %4095s", method, target) != 2 || target[0] != '/' )
+      continue;
+    if ( rp_field(&str, fields[3], sizeof(fields[3])) == NULL )
+      continue;
+    status = atoi(fields[3]);
+    /* Bytes, then referer and user agent of combined format. */
+    rp_field(&str, fields[3], sizeof(fields[3]));
+    if ( rp_field(&str, referer, sizeof(referer)) == NULL )
+      strcpy(referer, "-");
+    if ( rp_field(&str, agent, sizeof(agent)) == NULL )
+      strcpy(agent, "-");
+
+    length = snprintf(request, sizeof(request), "%s %s HTTP/1.1\r\nHost: %s\r\n%s%s%s%s%s%s"
+      "Accept: */*\r\n%sConnection: close\r\n\r\n",
+      method, target, host,
+      strcmp(agent, "-") ? "User-Agent: " : "", strcmp(agent, "-") ? agent : "", strcmp(agent, "-") ? "\r\n" : "",
+      strcmp(referer, "-") ? "Referer: " : "", strcmp(referer, "-") ? referer : "", strcmp(referer, "-") ? "\r\n" : "",
+      strcmp(method, "POST") ? "" : "Content-Length: 0\r\n");
+    if ( length >= (int)sizeof(request) )
+      continue;
+
+    printf("%d %s %d - %d\n", tls, tls ? host : "-", expect ? status : 0, length);
+    fwrite(request, 1, length, stdout);
+    printf("\n");
+    imported++;
+  }
+
+  fclose(f);
+  fprintf(stderr, "Imported %d of %d lines.\n", imported, lines);
+  return imported > 0 ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int main(int argc, char **argv) {
+
+  struct rp_thread *threads;
+  struct bc_samples *parts, samples;
+  const char *capture, *address, *import, *host;
+  int port, tls_port, concurrency, loops, tls, expect, i, need_tls;
+  unsigned long long errors, mismatches;
+  long long elapsed;
+
+  capture = import = NULL;
+  address = "127.0.0.1";
+  host = "localhost";
+  port = 8080;
+  tls_port = 8443;
+  concurrency = 4;
+  loops = 1;
+  tls = 0;
+  expect = 1;
+
+  for ( i = 1; i < argc; i++ ) {
+    if ( argv[i][0] != '-' ) {
+      usage();
+      return EXIT_FAILURE;
+    }
+    switch ( argv[i][1] ) {
+      case 'T':
+        tls = 1; continue;
+      case 'N':
+        expect = 0; continue;
+    }
+    if ( i + 1 >= argc ) {
+      usage();
+      return EXIT_FAILURE;
+    }
+    switch ( argv[i++][1] ) {
+      case 'f': capture = argv[i]; break;
+      case 'I': import = argv[i]; break;
+      case 'H': host = argv[i]; break;
+      case 'a': address = argv[i]; break;
+      case 'p': port = atoi(argv[i]); break;
+      case 'k': tls_port = atoi(argv[i]); break;
+      case 'c': concurrency = atoi(argv[i]); break;
+      case 'r': rate = strtod(argv[i], NULL); break;
+      case 'n': loops = atoi(argv[i]); break;
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+
+  if ( import )
+    return rp_import(import, host, tls, expect) < 0 ? EXIT_FAILURE : 0;
+
+  if ( capture == NULL || concurrency <= 0 || loops <= 0 || rate < 0 ) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  if ( rp_load(capture) < 0 )
+    return EXIT_FAILURE;
+
+  memset(&plain_target, 0, sizeof(plain_target));
+  plain_target.sin_family = AF_INET;
+  if ( inet_pton(AF_INET, address, &plain_target.sin_addr) != 1 ) {
+    fprintf(stderr, "ERROR: Invalid address %s.\n", address);
+    return EXIT_FAILURE;
+  }
+  tls_target = plain_target;
+  plain_target.sin_port = htons(port);
+  tls_target.sin_port = htons(tls_port);
+
+  need_tls = 0;
+  for ( i = 0; i < record_count; i++ )
+    need_tls |= records[i].tls;
+  if ( need_tls ) {
+    ssl_context = bc_ssl_context();
+    if ( ssl_context == NULL )
+      return EXIT_FAILURE;
+  }
+
+  threads = calloc(concurrency, sizeof(struct rp_thread));
+  parts = calloc(concurrency, sizeof(struct bc_samples));
+  if ( threads == NULL || parts == NULL )
+    return EXIT_FAILURE;
+
+  total = (long long)record_count * loops;
+  started = bc_clock_ns();
+
+  for ( i = 0; i < concurrency; i++ ) {
+    threads[i].samples = &parts[i];
+    if ( pthread_create(&threads[i].thread, NULL, rp_thread_run, &threads[i]) != 0 ) {
+      fprintf(stderr, "ERROR: Thread could not be created.\n");
+      return EXIT_FAILURE;
+    }
+  }
+  errors = mismatches = 0;
+  for ( i = 0; i < concurrency; i++ ) {
+    pthread_join(threads[i].thread, NULL);
+    errors += threads[i].errors;
+    mismatches += threads[i].mismatches;
+  }
+  elapsed = bc_clock_ns() - started;
+
+  if ( bc_samples_merge(&samples, parts, concurrency) < 0 )
+    return EXIT_FAILURE;
+
+  printf("requests,errors,mismatches,seconds,rps,p50_us,p90_us,p99_us,p999_us\n");
+  printf("%zu,%llu,%llu,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+    samples.count, errors, mismatches, elapsed / 1e9, samples.count / (elapsed / 1e9),
+    bc_quantile_us(&samples, 0.5),
+    bc_quantile_us(&samples, 0.9),
+    bc_quantile_us(&samples, 0.99),
+    bc_quantile_us(&samples, 0.999));
+
+  free(samples.values);
+  free(parts);
+  free(threads);
+  return ( errors || mismatches ) ? EXIT_FAILURE : 0;
+}
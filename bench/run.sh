@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# Run every scenario against a local tinysrv, with keep-alive off and on,
+# and print one CSV line per run. Tunables are taken from environment:
+#
+#   BENCH_DURATION     seconds per run (default 5)
+#   BENCH_CONCURRENCY  client threads (default 8)
+#   BENCH_WORKERS      tinysrv worker processes (default 1)
+#   BENCH_PORT         plain HTTP port (default 18080)
+#   BENCH_TLS_PORT     HTTPS port (default 18443)
+#   BENCH_TLS          1 when tinysrv and loadgen are built with USE_SSL
+#   BENCH_SCENARIOS    scenario files (default bench/scenarios/*.conf)
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+DURATION=${BENCH_DURATION:-5}
+CONCURRENCY=${BENCH_CONCURRENCY:-8}
+WORKERS=${BENCH_WORKERS:-1}
+PORT=${BENCH_PORT:-18080}
+TLS_PORT=${BENCH_TLS_PORT:-18443}
+TLS=${BENCH_TLS:-0}
+SCENARIOS=${BENCH_SCENARIOS:-bench/scenarios/*.conf}
+
+# A server left on the port would answer instead, and measured PIDs would serve nothing.
+ports=$PORT
+[ "$TLS" = 1 ] && ports="$ports $TLS_PORT"
+for port in $ports; do
+  if [ -n "$(ss -ltnH "sport = :$port")" ]; then
+    echo "Port $port is already in use, set BENCH_PORT or BENCH_TLS_PORT." >&2
+    exit 1
+  fi
+done
+
+dir=$(mktemp -d)
+pid=
+cleanup() {
+  [ -n "$pid" ] && kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null
+  rm -rf "$dir"
+}
+trap cleanup EXIT INT TERM
+
+# Document root with a file of fixed content for the static scenario.
+mkdir -p "$dir/www/bench.test" "$dir/certs"
+yes 'console.log("tinysrv bench");' | head -c 16384 > "$dir/www/bench.test/static.js"
+
+listeners="-c -S $dir/www/ -p $PORT 127.0.0.1"
+if [ "$TLS" = 1 ]; then
+  openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=bench.test \
+    -keyout "$dir/key.pem" -out "$dir/cert.pem" 2>/dev/null
+  cat "$dir/key.pem" "$dir/cert.pem" > "$dir/certs/bench_test"
+  listeners="$listeners -c -C $dir/certs -k $TLS_PORT 127.0.0.1"
+fi
+
+./tinysrv -f -w "$WORKERS" -n /tinysrv-bench $listeners 2>/dev/null &
+pid=$!
+sleep 1
+kill -0 "$pid"
+
+# Supervisor and all of its subprocesses are measured for CPU time.
+pids=$pid
+for child in $(ps -o pid= --ppid "$pid"); do
+  pids="$pids,$child"
+done
+
+for port in $ports; do
+  if ! ss -ltnpH "sport = :$port" | grep -Eq "pid=($(echo "$pids" | tr , '|')),"; then
+    echo "Port $port is not served by measured tinysrv." >&2
+    exit 1
+  fi
+done
+
+bench/loadgen -H
+for scenario in $SCENARIOS; do
+  if [ "$TLS" != 1 ] && grep -q '^tls 1' "$scenario"; then
+    continue
+  fi
+  for keepalive in "" -K; do
+    bench/loadgen -s "$scenario" -p "$PORT" -k "$TLS_PORT" -c "$CONCURRENCY" \
+      -d "$DURATION" -P "$pids" $keepalive
+  done
+done
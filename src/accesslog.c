@@ -0,0 +1,260 @@
+#include "accesslog.h"
+#include "stats.h"
+
+#include <arpa/inet.h> /* inet_ntop() */
+#include <errno.h>
+#include <fcntl.h> /* open(), O_APPEND, O_CREAT, O_WRONLY */
+#include <netinet/in.h> /* struct sockaddr_in, struct sockaddr_in6 */
+#include <stdio.h> /* rename(), snprintf() */
+#include <string.h> /* memcpy(), memset() */
+#include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* fstat(), struct stat */
+#include <syslog.h>
+#include <time.h> /* gmtime_r(), nanosleep(), strftime() */
+#include <unistd.h> /* close(), write() */
+
+#define TS_LOG_BUFFER_SIZE 65536
+#define TS_LOG_LINE_LENGTH 256
+
+/* Label values indexed by response_enum. */
+static const char *const ts_log_response_names[SEND_RESPONSE_TYPES] = {
+  "css", "file", "gif", "html", "ico", "jpg", "webp", "js", "png", "swf", "txt",
+  "no_ext", "unk_ext", "204", "redirect", "jsclose", "stats", "nossl", "error"
+};
+
+static ts_log_ring_t *ts_log_rings = NULL;
+static unsigned int ts_log_workers = 0;
+static unsigned int ts_log_sample = 1;
+
+/* Ring of this worker. */
+static __thread ts_log_ring_t *ts_log_ring = NULL;
+
+/* Create rings for all workers in memory shared with writer process. */
+int ts_log_init(unsigned int workers, unsigned int sample) {
+
+  void *rings;
+
+  rings = mmap(NULL, workers * sizeof(ts_log_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if ( rings == MAP_FAILED ) {
+    syslog(LOG_WARNING, "Cannot allocate access log rings: %m.");
+    return -1;
+  }
+
+  ts_log_rings = rings;
+  ts_log_workers = workers;
+  ts_log_sample = ( sample > 0 ) ? sample : 1;
+  return 0;
+}
+
+void ts_log_attach(unsigned int index) {
+
+  if ( ts_log_rings && index < ts_log_workers )
+    ts_log_ring = &ts_log_rings[index];
+}
+
+int ts_log_enabled(void) {
+
+  return ts_log_ring != NULL;
+}
+
+unsigned int ts_log_hash(const char *str) {
+
+  unsigned int hash;
+
+  hash = 2166136261U;
+  while ( *str ) {
+    hash ^= (unsigned char)*str++;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+static void ts_log_address_copy(unsigned char *bytes, const struct sockaddr_storage *addr) {
+
+  if ( addr->ss_family == AF_INET )
+    memcpy(bytes, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+  else if ( addr->ss_family == AF_INET6 )
+    memcpy(bytes, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+}
+
+void ts_log_address(ts_log_record_t *record, const struct sockaddr_storage *peer, const struct sockaddr_storage *server) {
+
+  record->family = peer->ss_family;
+  ts_log_address_copy(record->addr, peer);
+  if ( server->ss_family == peer->ss_family )
+    ts_log_address_copy(record->server, server);
+}
+
+/* Never blocks, record is dropped and counted when writer does not keep up. */
+void ts_log_push(const ts_log_record_t *record) {
+
+  ts_log_ring_t *ring;
+  unsigned long long head;
+
+  ring = ts_log_ring;
+
+  if ( ts_log_sample > 1 && ring->sampled++ % ts_log_sample )
+    return;
+
+  head = ring->head;
+  if ( head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TS_LOG_RING_SIZE ) {
+    TS_STATS_INC(log_drops);
+    return;
+  }
+
+  ring->record[head & (TS_LOG_RING_SIZE - 1)] = *record;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int ts_log_format(char *buf, const ts_log_record_t *record) {
+
+  static time_t last_second = -1;
+  static char date[24];
+
+  char addr[INET6_ADDRSTRLEN], server[INET6_ADDRSTRLEN];
+  struct tm tm;
+  time_t second;
+
+  /* Date is formatted only once per second. */
+  second = record->timestamp / 1000000;
+  if ( second != last_second ) {
+    gmtime_r(&second, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+    last_second = second;
+  }
+
+  if ( inet_ntop(record->family, record->addr, addr, sizeof(addr)) == NULL ||
+       inet_ntop(record->family, record->server, server, sizeof(server)) == NULL ) {
+    strcpy(addr, "-");
+    strcpy(server, "-");
+  }
+
+  return snprintf(buf, TS_LOG_LINE_LENGTH, "%s.%06dZ %s %s %.*s %08x %s %u %u %u\n",
+    date, (int)(record->timestamp % 1000000), addr, server,
+    TS_LOG_HOST_LENGTH, *record->host ? record->host : "-",
+    record->path_hash,
+    ( record->response_type < SEND_RESPONSE_TYPES ) ? ts_log_response_names[record->response_type] : "-",
+    record->status, record->bytes, record->latency);
+}
+
+static int ts_log_flush(int fd, const char *buf, int length) {
+
+  int rv, written;
+
+  for ( written = 0; written < length; written += rv ) {
+    rv = write(fd, buf + written, length - written);
+    if ( rv < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      return -1;
+    }
+  }
+  return written;
+}
+
+static int ts_log_open(const char *path, long long *size) {
+
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if ( fd < 0 ) {
+    syslog(LOG_ERR, "Cannot open access log %s: %m.", path);
+    return -1;
+  }
+
+  *size = ( fstat(fd, &st) == 0 ) ? st.st_size : 0;
+  return fd;
+}
+
+/* Keep one rotated file with .1 suffix. */
+static int ts_log_rotate(int fd, const char *path, long long *size) {
+
+  char rotated[MAX_PATH_LENGTH];
+
+  close(fd);
+  if ( snprintf(rotated, sizeof(rotated), "%s.1", path) < (int)sizeof(rotated) )
+    rename(path, rotated);
+  return ts_log_open(path, size);
+}
+
+/*
+Drain rings of all workers and write formatted lines to file in batches. File
+is opened again when reload counter changes, after it was rotated externally.
+*/
+int ts_log_writer_run(const char *path, long long rotate_size, volatile int *stop, volatile int *reload) {
+
+  static char buf[TS_LOG_BUFFER_SIZE];
+
+  ts_log_ring_t *ring;
+  unsigned long long head, tail;
+  unsigned int index, records;
+  struct timespec idle;
+  long long size;
+  int fd, length, reloaded;
+
+  if ( ts_log_rings == NULL )
+    return -1;
+
+  fd = ts_log_open(path, &size);
+  if ( fd < 0 )
+    return -1;
+  reloaded = *reload;
+
+  for (;;) {
+
+    records = 0;
+    length = 0;
+
+    for ( index = 0; index < ts_log_workers; index++ ) {
+
+      ring = &ts_log_rings[index];
+      tail = ring->tail;
+      head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+      for ( ; tail < head; tail++, records++ ) {
+        if ( length > TS_LOG_BUFFER_SIZE - TS_LOG_LINE_LENGTH ) {
+          ts_log_flush(fd, buf, length);
+          size += length;
+          length = 0;
+        }
+        length += ts_log_format(buf + length, &ring->record[tail & (TS_LOG_RING_SIZE - 1)]);
+      }
+
+      /* Slots are released only after records were copied out. */
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    if ( length > 0 ) {
+      if ( ts_log_flush(fd, buf, length) < 0 )
+        syslog(LOG_WARNING, "Cannot write access log %s: %m.", path);
+      size += length;
+    }
+
+    if ( rotate_size > 0 && size >= rotate_size ) {
+      fd = ts_log_rotate(fd, path, &size);
+      if ( fd < 0 )
+        return -1;
+    }
+
+    if ( *reload != reloaded ) {
+      reloaded = *reload;
+      close(fd);
+      fd = ts_log_open(path, &size);
+      if ( fd < 0 )
+        return -1;
+    }
+
+    if ( records == 0 ) {
+      /* Rings are drained, so it is safe to stop now. */
+      if ( *stop )
+        break;
+      idle.tv_sec = 0;
+      idle.tv_nsec = TS_LOG_WRITER_IDLE * 1000000L;
+      nanosleep(&idle, NULL);
+    }
+  }
+
+  close(fd);
+  return 0;
+}
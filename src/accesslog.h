@@ -0,0 +1,55 @@
+#ifndef _TINYSRV_ACCESSLOG_H
+#define _TINYSRV_ACCESSLOG_H
+
+#include "project.h"
+
+#include <sys/socket.h> /* struct sockaddr_storage */
+
+/* Records per worker, must be power of two. */
+#define TS_LOG_RING_SIZE 4096
+#define TS_LOG_HOST_LENGTH 48
+/* Writer sleeps this many milliseconds when all rings are empty. */
+#define TS_LOG_WRITER_IDLE 50
+
+/* Fixed size binary record, formatted to text by writer only. */
+struct ts_log_record {
+  /* Wall clock time in microseconds. */
+  long long timestamp;
+  unsigned char addr[16];
+  /* Address the client connected to, of the same family. */
+  unsigned char server[16];
+  unsigned char family;
+  unsigned char response_type;
+  unsigned short status;
+  unsigned int bytes;
+  /* Accept to close in microseconds. */
+  unsigned int latency;
+  /* FNV-1a hash of path without query. */
+  unsigned int path_hash;
+  char host[TS_LOG_HOST_LENGTH];
+};
+
+typedef struct ts_log_record ts_log_record_t;
+
+/*
+Single producer single consumer ring of one worker. Producer owns head, consumer
+owns tail, both are on separate cache lines.
+*/
+struct ts_log_ring {
+  unsigned long long head __attribute__((aligned(TS_CACHE_LINE)));
+  unsigned long long sampled;
+  unsigned long long tail __attribute__((aligned(TS_CACHE_LINE)));
+  ts_log_record_t record[TS_LOG_RING_SIZE] __attribute__((aligned(TS_CACHE_LINE)));
+};
+
+typedef struct ts_log_ring ts_log_ring_t;
+
+int ts_log_init(unsigned int, unsigned int);
+void ts_log_attach(unsigned int);
+int ts_log_enabled(void);
+unsigned int ts_log_hash(const char *);
+void ts_log_address(ts_log_record_t *, const struct sockaddr_storage *, const struct sockaddr_storage *);
+void ts_log_push(const ts_log_record_t *);
+int ts_log_writer_run(const char *, long long, volatile int *, volatile int *);
+
+#endif
@@ -0,0 +1,256 @@
+#include "affinity.h"
+
+#include <dirent.h> /* opendir(), readdir() */
+#include <linux/filter.h> /* struct sock_filter, SKF_AD_CPU, SKF_AD_RANDOM */
+#include <stdio.h> /* fopen(), snprintf() */
+#include <stdlib.h> /* atoi(), qsort(), strtol() */
+#include <string.h>
+#include <sys/socket.h> /* setsockopt() */
+#include <syslog.h>
+
+/* Parse list like "0-3,8,10-11". Returns number of CPUs, or -1 on error. */
+int ts_cpulist_parse(const char *str, cpu_set_t *set) {
+
+  long first, last;
+  char *end;
+
+  CPU_ZERO(set);
+  while ( *str && *str != '\n' ) {
+
+    first = strtol(str, &end, 10);
+    if ( end == str || first < 0 || first >= CPU_SETSIZE )
+      return -1;
+    last = first;
+    if ( *end == '-' ) {
+      str = end + 1;
+      last = strtol(str, &end, 10);
+      if ( end == str || last < first || last >= CPU_SETSIZE )
+        return -1;
+    }
+    for ( ; first <= last; first++ )
+      CPU_SET(first, set);
+
+    str = end;
+    if ( *str == ',' )
+      str++;
+    else if ( *str && *str != '\n' )
+      return -1;
+  }
+
+  return CPU_COUNT(set);
+}
+
+static int ts_cpulist_read(const char *path, cpu_set_t *set) {
+
+  char line[1024];
+  FILE *f;
+  int rv;
+
+  f = fopen(path, "r");
+  if ( f == NULL )
+    return -1;
+  rv = fgets(line, sizeof(line), f) ? ts_cpulist_parse(line, set) : -1;
+  fclose(f);
+  return rv;
+}
+
+static int ts_compare_int(const void *a, const void *b) {
+
+  return *(const int *)a - *(const int *)b;
+}
+
+/*
+CPUs which handle interrupts of network device, in order of its queues, so
+that worker i sits on the CPU of queue i.
+*/
+static int ts_nic_irq_cpus(const char *nic, int *order, int max) {
+
+  char path[MAX_PATH_LENGTH];
+  cpu_set_t set, seen;
+  struct dirent *entry;
+  DIR *dir;
+  int irqs[CPU_SETSIZE];
+  int irq_count, count, cpu, i;
+
+  snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", nic);
+  dir = opendir(path);
+  if ( dir == NULL )
+    return 0;
+  irq_count = 0;
+  while ( (entry = readdir(dir)) != NULL && irq_count < CPU_SETSIZE )
+    if ( entry->d_name[0] != '.' )
+      irqs[irq_count++] = atoi(entry->d_name);
+  closedir(dir);
+
+  /* Vectors of queues are allocated in order. */
+  qsort(irqs, irq_count, sizeof(int), ts_compare_int);
+
+  CPU_ZERO(&seen);
+  count = 0;
+  for ( i = 0; i < irq_count && count < max; i++ ) {
+    snprintf(path, sizeof(path), "/proc/irq/%d/effective_affinity_list", irqs[i]);
+    if ( ts_cpulist_read(path, &set) <= 0 ) {
+      snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irqs[i]);
+      if ( ts_cpulist_read(path, &set) <= 0 )
+        continue;
+    }
+    /* Interrupt spread over many CPUs says nothing about locality. */
+    if ( CPU_COUNT(&set) != 1 )
+      continue;
+    for ( cpu = 0; cpu < CPU_SETSIZE; cpu++ )
+      if ( CPU_ISSET(cpu, &set) && !CPU_ISSET(cpu, &seen) ) {
+        CPU_SET(cpu, &seen);
+        order[count++] = cpu;
+      }
+  }
+
+  return count;
+}
+
+/*
+Choose CPU of every worker. With -A workers take CPUs of the list in turn.
+With -N the IRQ CPUs of network device come first, followed by the rest of
+CPUs of its NUMA node, both limited to the -A list when given.
+*/
+int ts_affinity_plan(ts_configuration_t *config, ts_worker_t *workers) {
+
+  char path[MAX_PATH_LENGTH];
+  cpu_set_t allowed, local;
+  int order[CPU_SETSIZE];
+  int count, i, cpu;
+  unsigned int index;
+
+  for ( index = 0; index < config->max_workers; index++ )
+    workers[index].cpu = -1;
+
+  if ( config->cpus == NULL && config->nic == NULL )
+    return 0;
+
+  if ( config->cpus == NULL ) {
+    if ( sched_getaffinity(0, sizeof(allowed), &allowed) < 0 ) {
+      syslog(LOG_WARNING, "sched_getaffinity: %m");
+      return -1;
+    }
+  }
+  else if ( ts_cpulist_parse(config->cpus, &allowed) <= 0 ) {
+    syslog(LOG_ERR, "Invalid CPU list %s.", config->cpus);
+    return -1;
+  }
+
+  count = 0;
+  if ( config->nic != NULL ) {
+
+    count = ts_nic_irq_cpus(config->nic, order, CPU_SETSIZE);
+    for ( i = 0, cpu = 0; i < count; i++ )
+      if ( CPU_ISSET(order[i], &allowed) )
+        order[cpu++] = order[i];
+    count = cpu;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/local_cpulist", config->nic);
+    if ( ts_cpulist_read(path, &local) <= 0 ) {
+      syslog(LOG_WARNING, "Unknown NUMA node of network device %s, all CPUs are used.", config->nic);
+      local = allowed;
+    }
+    CPU_AND(&allowed, &allowed, &local);
+    if ( count == 0 && CPU_COUNT(&allowed) == 0 ) {
+      syslog(LOG_WARNING, "No allowed CPU is local to network device %s, workers are not pinned.", config->nic);
+      return -1;
+    }
+  }
+
+  /* Remaining allowed CPUs after the IRQ CPUs. */
+  for ( i = 0; i < count; i++ )
+    CPU_CLR(order[i], &allowed);
+  for ( cpu = 0; cpu < CPU_SETSIZE; cpu++ )
+    if ( CPU_ISSET(cpu, &allowed) )
+      order[count++] = cpu;
+
+  for ( index = 0; index < config->max_workers; index++ ) {
+    workers[index].cpu = order[index % count];
+    syslog(LOG_INFO, "Worker %u is pinned to CPU %d.", index, workers[index].cpu);
+  }
+
+  return 0;
+}
+
+int ts_affinity_set(int cpu) {
+
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if ( sched_setaffinity(0, sizeof(set), &set) < 0 ) {
+    syslog(LOG_WARNING, "sched_setaffinity %d: %m", cpu);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+Attach program to reuseport group of sockfd which picks the socket of worker
+pinned to the CPU that received the connection. Sockets of the group are in
+worker order. Unpinned CPUs fall back to CPU id modulo number of workers.
+*/
+int ts_affinity_steer(int sockfd, ts_worker_t *workers, unsigned int count) {
+
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+  struct sock_filter code[2 * CPU_SETSIZE + 3];
+  struct sock_fprog prog;
+  unsigned int index, length;
+
+  length = 0;
+  code[length++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+  for ( index = 0; index < count && length < 2 * CPU_SETSIZE + 1; index++ ) {
+    if ( workers[index].cpu < 0 )
+      continue;
+    code[length++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, workers[index].cpu, 0, 1);
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, index);
+  }
+  code[length++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count);
+  code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+  prog.len = length;
+  prog.filter = code;
+  if ( setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0 ) {
+    /* Kernel keeps distributing connections by hash. */
+    syslog(LOG_WARNING, "SO_ATTACH_REUSEPORT_CBPF: %m, connections are not steered by CPU.");
+    return -1;
+  }
+  return 0;
+#else
+  (void)sockfd;
+  (void)workers;
+  (void)count;
+  syslog(LOG_WARNING, "Reuseport BPF is not supported, connections are not steered by CPU.");
+  return -1;
+#endif
+}
+
+/*
+Attach program to reuseport group of sockfd which spreads connections at
+random over its first count sockets, those of workers running.
+*/
+int ts_affinity_spread(int sockfd, unsigned int count) {
+
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_RANDOM)
+  struct sock_filter code[3];
+  struct sock_fprog prog;
+
+  code[0] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_RANDOM);
+  code[1] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count);
+  code[2] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+  prog.len = 3;
+  prog.filter = code;
+  if ( setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0 ) {
+    syslog(LOG_WARNING, "SO_ATTACH_REUSEPORT_CBPF: %m, connections are spread over retired workers too.");
+    return -1;
+  }
+  return 0;
+#else
+  (void)sockfd;
+  (void)count;
+  syslog(LOG_WARNING, "Reuseport BPF is not supported, connections are spread over retired workers too.");
+  return -1;
+#endif
+}
@@ -0,0 +1,15 @@
+#ifndef _TINYSRV_AFFINITY_H
+#define _TINYSRV_AFFINITY_H
+
+#include "project.h"
+#include "config.h"
+
+#include <sched.h> /* cpu_set_t */
+
+int ts_cpulist_parse(const char *, cpu_set_t *);
+int ts_affinity_plan(ts_configuration_t *, ts_worker_t *);
+int ts_affinity_set(int);
+int ts_affinity_steer(int, ts_worker_t *, unsigned int);
+int ts_affinity_spread(int, unsigned int);
+
+#endif
@@ -0,0 +1,95 @@
+#include "arena.h"
+#include "project.h"
+
+#include <stdlib.h> /* free(), malloc() */
+#include <string.h> /* memcpy(), strlen(), strnlen() */
+
+#define TS_ARENA_ALIGN(x) (((x) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+static struct ts_arena_chunk *ts_arena_chunk_new(size_t size) {
+
+  struct ts_arena_chunk *chunk;
+
+  chunk = malloc(sizeof(struct ts_arena_chunk) + size);
+  if ( chunk == NULL )
+    return NULL;
+
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+int ts_arena_init(ts_arena_t *arena) {
+
+  arena->head = ts_arena_chunk_new(TS_ARENA_CHUNK_SIZE);
+  arena->current = arena->head;
+  return ( arena->head ) ? 0 : -1;
+}
+
+void *ts_arena_alloc(ts_arena_t *arena, size_t size) {
+
+  struct ts_arena_chunk *chunk, *new_chunk;
+  void *ptr;
+
+  size = TS_ARENA_ALIGN(size);
+
+  /* Use the first of already allocated chunks with enough space. */
+  for ( chunk = arena->current; chunk; chunk = chunk->next ) {
+    if ( chunk->size - chunk->used >= size )
+      break;
+    if ( chunk->next == NULL ) {
+      new_chunk = ts_arena_chunk_new(( size > TS_ARENA_CHUNK_SIZE ) ? size : TS_ARENA_CHUNK_SIZE);
+      if ( new_chunk == NULL )
+        return NULL;
+      chunk->next = new_chunk;
+    }
+  }
+
+  if ( chunk == NULL )
+    return NULL;
+
+  arena->current = chunk;
+  ptr = chunk->data + chunk->used;
+  chunk->used += size;
+  return ptr;
+}
+
+char *ts_arena_strndup(ts_arena_t *arena, const char *str, size_t length) {
+
+  char *dst;
+
+  length = strnlen(str, length);
+  dst = ts_arena_alloc(arena, length + 1);
+  if ( dst == NULL )
+    return NULL;
+  memcpy(dst, str, length);
+  dst[length] = 0;
+  return dst;
+}
+
+char *ts_arena_strdup(ts_arena_t *arena, const char *str) {
+
+  return ts_arena_strndup(arena, str, strlen(str));
+}
+
+void ts_arena_reset(ts_arena_t *arena) {
+
+  struct ts_arena_chunk *chunk;
+
+  for ( chunk = arena->head; chunk; chunk = chunk->next )
+    chunk->used = 0;
+  arena->current = arena->head;
+}
+
+void ts_arena_free(ts_arena_t *arena) {
+
+  struct ts_arena_chunk *chunk;
+
+  while ( arena->head ) {
+    chunk = arena->head;
+    arena->head = chunk->next;
+    free(chunk);
+  }
+  arena->current = NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef _TINYSRV_ARENA_H
+#define _TINYSRV_ARENA_H
+
+#include <stddef.h>
+
+#define TS_ARENA_CHUNK_SIZE 16384
+
+struct ts_arena_chunk {
+  struct ts_arena_chunk *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+/*
+Bump pointer allocator for request scoped memory. Allocations are never freed
+one by one, the whole arena is reset when the request is done. Chunks are kept
+on reset, so a worker does not allocate memory once it has seen its largest request.
+*/
+struct ts_arena {
+  struct ts_arena_chunk *head;
+  struct ts_arena_chunk *current;
+};
+
+typedef struct ts_arena ts_arena_t;
+
+int ts_arena_init(ts_arena_t *);
+void *ts_arena_alloc(ts_arena_t *, size_t);
+char *ts_arena_strdup(ts_arena_t *, const char *);
+char *ts_arena_strndup(ts_arena_t *, const char *, size_t);
+void ts_arena_reset(ts_arena_t *);
+void ts_arena_free(ts_arena_t *);
+
+#endif
@@ -0,0 +1,117 @@
+#include "cache.h"
+#include "epoch.h"
+#include "utils.h"
+
+#include <stdlib.h> /* free(), malloc() */
+#include <string.h> /* memcpy(), strcmp(), strlen() */
+
+static unsigned int ts_cache_hash(const char *str) {
+
+  unsigned int hash;
+
+  hash = 2166136261U;
+  while ( *str ) {
+    hash ^= (unsigned char)*str++;
+    hash *= 16777619U;
+  }
+  return hash % TS_CACHE_BUCKETS;
+}
+
+static void ts_cache_entry_release(void *ptr) {
+
+  ts_cache_entry_t *entry;
+
+  entry = (ts_cache_entry_t *)ptr;
+  entry->release(entry->value);
+  free(entry);
+}
+
+/* Caller must be inside an epoch for as long as it uses the entry. */
+ts_cache_entry_t *ts_cache_find(ts_cache_t *cache, const char *path) {
+
+  ts_cache_entry_t *entry;
+
+  for ( entry = __atomic_load_n(&cache->bucket[ts_cache_hash(path)], __ATOMIC_ACQUIRE); entry;
+        entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE) )
+    if ( !strcmp(entry->path, path) )
+      return entry;
+
+  return NULL;
+}
+
+int ts_cache_valid(const ts_cache_entry_t *entry, const struct stat *st) {
+
+  return entry->dev == st->st_dev && entry->ino == st->st_ino && entry->size == st->st_size &&
+         entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+Publish value for path, replacing an older entry. Returns NULL when cache is
+full, the caller then keeps the value.
+*/
+ts_cache_entry_t *ts_cache_insert(ts_cache_t *cache, const char *path, const struct stat *st, void *value) {
+
+  ts_cache_entry_t *entry, *old, **link;
+  size_t length;
+
+  length = strlen(path) + 1;
+  entry = malloc(sizeof(ts_cache_entry_t) + length);
+  if ( entry == NULL )
+    return NULL;
+
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->size = st->st_size;
+  entry->mtime = st->st_mtim;
+  entry->checked = ts_clock_ms();
+  entry->value = value;
+  entry->release = cache->release;
+  memcpy(entry->path, path, length);
+
+  pthread_mutex_lock(&cache->lock);
+
+  link = &cache->bucket[ts_cache_hash(path)];
+  for ( old = *link; old; link = &old->next, old = old->next )
+    if ( !strcmp(old->path, path) )
+      break;
+
+  if ( old == NULL && cache->count >= cache->max ) {
+    pthread_mutex_unlock(&cache->lock);
+    free(entry);
+    return NULL;
+  }
+
+  /* Readers see either the old or the new entry, never a partial one. */
+  entry->next = old ? old->next : *link;
+  __atomic_store_n(link, entry, __ATOMIC_RELEASE);
+  if ( old == NULL )
+    cache->count++;
+
+  pthread_mutex_unlock(&cache->lock);
+
+  if ( old )
+    ts_epoch_retire(old, ts_cache_entry_release);
+
+  return entry;
+}
+
+/* Drop all entries, they are released once no reader can see them. */
+void ts_cache_clear(ts_cache_t *cache) {
+
+  ts_cache_entry_t *list[TS_CACHE_BUCKETS], *entry;
+  unsigned int index;
+
+  pthread_mutex_lock(&cache->lock);
+  for ( index = 0; index < TS_CACHE_BUCKETS; index++ ) {
+    list[index] = cache->bucket[index];
+    __atomic_store_n(&cache->bucket[index], NULL, __ATOMIC_RELEASE);
+  }
+  cache->count = 0;
+  pthread_mutex_unlock(&cache->lock);
+
+  for ( index = 0; index < TS_CACHE_BUCKETS; index++ )
+    while ( (entry = list[index]) != NULL ) {
+      list[index] = entry->next;
+      ts_epoch_retire(entry, ts_cache_entry_release);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef _TINYSRV_CACHE_H
+#define _TINYSRV_CACHE_H
+
+#include "project.h"
+
+#include <pthread.h>
+#include <sys/stat.h> /* struct stat */
+#include <sys/types.h> /* dev_t, ino_t, off_t */
+#include <time.h> /* struct timespec */
+
+#define TS_CACHE_BUCKETS 256
+
+/*
+Entry for one file, value is valid as long as the file keeps its identity.
+Entries are never changed once published, a changed file gets a new entry.
+*/
+struct ts_cache_entry {
+  struct ts_cache_entry *next;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  /* Monotonic time of the last stat() in milliseconds, the only field written after publishing. */
+  long long checked;
+  void *value;
+  void (*release)(void *);
+  char path[];
+};
+
+typedef struct ts_cache_entry ts_cache_entry_t;
+
+/*
+Cache keyed by file path shared by all workers of a process. Lookups are done
+inside an epoch without locking, inserts take the lock and replaced entries
+are retired.
+*/
+struct ts_cache {
+  ts_cache_entry_t *bucket[TS_CACHE_BUCKETS];
+  unsigned int count;
+  unsigned int max;
+  void (*release)(void *);
+  pthread_mutex_t lock;
+};
+
+typedef struct ts_cache ts_cache_t;
+
+#define TS_CACHE_INITIALIZER(max, release) { { NULL }, 0, (max), (release), PTHREAD_MUTEX_INITIALIZER }
+
+ts_cache_entry_t *ts_cache_find(ts_cache_t *, const char *);
+int ts_cache_valid(const ts_cache_entry_t *, const struct stat *);
+ts_cache_entry_t *ts_cache_insert(ts_cache_t *, const char *, const struct stat *, void *);
+void ts_cache_clear(ts_cache_t *);
+
+#endif
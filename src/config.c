@@ -1,17 +1,27 @@
 #include "config.h"
+#include "affinity.h"
+#include "ratelimit.h"
 
-#include <stdlib.h> /* free(), malloc() */
+#include <stdlib.h> /* atof(), atoi(), atoll(), free(), malloc(), strtol() */
 #include <string.h>
 #include <syslog.h>
 
 static void ts_socket_load_defaults(ts_socket_t *sock) {
 
   sock->ipaddr = NULL;
+  sock->prefix_length = 0;
   sock->port = NULL;
   sock->options = DO_204 | DO_REDIRECT;
   sock->serve_path_length = 0;
   sock->serve_path = NULL;
   sock->cert_path = NULL;
+  sock->defer_accept = 0;
+  sock->fastopen_qlen = 0;
+  sock->max_inflight = 0;
+  sock->teardown = TS_TEARDOWN_CLOSE;
+  sock->teardown_wait = TS_TEARDOWN_WAIT_DEFAULT;
+  sock->sockfds = NULL;
+  sock->index = 0;
 }
 
 static ts_socket_t *ts_socket_new(void) {
@@ -39,6 +49,8 @@ static int ts_socket_free(ts_socket_t *sock) {
   }
   if ( sock->cert_path )
     free(sock->cert_path);
+  if ( sock->sockfds )
+    free(sock->sockfds);
   free(sock);
   return 0;
 }
@@ -53,6 +65,24 @@ ts_configuration_t *ts_configuration_create(void) {
 
   config->user = NULL;
   config->pidfile = NULL;
+  config->stats_name = strdup("/" PROGRAM_NAME);
+  config->workers = 1;
+  config->max_workers = 0;
+  config->stall_timeout = TS_STALL_TIMEOUT;
+  config->max_inflight = 0;
+  config->client_rate = 0;
+  config->client_burst = 0;
+  config->client_memory = TS_RATELIMIT_MEMORY;
+  config->access_log = NULL;
+  config->log_sample = 1;
+  config->log_rotate_size = 0;
+  config->cpus = NULL;
+  config->nic = NULL;
+  config->incoming_cpu = 0;
+  config->steer_cpu = 0;
+  config->shared_listen = 0;
+  config->threads = 0;
+  config->wakefd = -1;
   config->do_foreground = 0;
   config->log_option = LOG_PID | LOG_CONS;
   config->sock = NULL;
@@ -64,6 +94,8 @@ ts_configuration_t *ts_configuration_create(void) {
 int ts_configuration_parse(ts_configuration_t *config, int argc, char **argv) {
 
   int i, error;
+  char *prefix, *end;
+  cpu_set_t cpus;
   ts_socket_t *cur_socket;
 
   cur_socket = ts_socket_new();
@@ -81,18 +113,50 @@ int ts_configuration_parse(ts_configuration_t *config, int argc, char **argv) {
           /* Disable HTTP 204 reply to generate_204 URLs. */
           cur_socket->options &= ~DO_204; continue;
 
+        case 'a':
+          /* Steer connections to the socket of worker on receiving CPU. */
+          config->incoming_cpu = 1; continue;
+
+        case 'b':
+          /* Choose socket by receiving CPU with reuseport BPF program. */
+          config->steer_cpu = 1; continue;
+
         case 'c':
           /* Return javascript window close script instead of plain response. */
           cur_socket->options |= DO_CLOSE; continue;
 
+        case 'e':
+          /* Workers share listen sockets instead of SO_REUSEPORT. */
+          config->shared_listen = 1; continue;
+
         case 'f':
           /* Stay in foreground - don't daemonize. */
           config->do_foreground = 1; config->log_option |= LOG_PERROR; continue;
 
+        case 't':
+          /* Run workers as threads of one process. */
+          config->threads = 1; continue;
+
+        case 'm':
+          /* Management listener, answer every request with statistics. */
+          cur_socket->options |= DO_ADMIN; continue;
+
         case 'R':
           /* Disable redirect to encoded path in tracker links. */
           cur_socket->options &= ~DO_REDIRECT; continue;
 
+        case 's':
+          /* Serve statistics on reserved URL. */
+          cur_socket->options |= DO_STATS; continue;
+
+        case 'X':
+          /* Shed connections over the cap by reset instead of 503. */
+          cur_socket->options |= DO_RESET; continue;
+
+        case 'd':
+          /* Serve TLS and plain HTTP on the same port. */
+          cur_socket->options |= DO_DETECT; continue;
+
         /* No default because we want to move on to the next section and process further. */
       }
 
@@ -128,6 +192,128 @@ int ts_configuration_parse(ts_configuration_t *config, int argc, char **argv) {
             config->user = strdup(argv[i]);
             continue;
 
+          case 'n':
+            /* Shared memory name must start with slash. */
+            if ( argv[i][0] != '/' ) {
+              error = 1;
+              continue;
+            }
+            if ( config->stats_name )
+              free(config->stats_name);
+            config->stats_name = strdup(argv[i]);
+            continue;
+
+          case 'l':
+            if ( config->access_log )
+              free(config->access_log);
+            config->access_log = strdup(argv[i]);
+            continue;
+
+          case 'L':
+            if ( atoi(argv[i]) < 1 )
+              error = 1;
+            else
+              config->log_sample = atoi(argv[i]);
+            continue;
+
+          case 'r':
+            config->log_rotate_size = atoll(argv[i]);
+            if ( config->log_rotate_size < 0 )
+              error = 1;
+            continue;
+
+          case 'A':
+            if ( ts_cpulist_parse(argv[i], &cpus) <= 0 ) {
+              error = 1;
+              continue;
+            }
+            if ( config->cpus )
+              free(config->cpus);
+            config->cpus = strdup(argv[i]);
+            continue;
+
+          case 'N':
+            if ( config->nic )
+              free(config->nic);
+            config->nic = strdup(argv[i]);
+            continue;
+
+          case 'w':
+            config->workers = atoi(argv[i]);
+            if ( config->workers < 1 || config->workers > TS_MAX_WORKERS )
+              error = 1;
+            continue;
+
+          case 'W':
+            config->max_workers = atoi(argv[i]);
+            if ( config->max_workers < 1 || config->max_workers > TS_MAX_WORKERS )
+              error = 1;
+            continue;
+
+          case 'H':
+            /* Seconds without heartbeat before a worker is replaced, 0 disables. */
+            if ( atoi(argv[i]) < 0 || (atoi(argv[i]) > 0 && atoi(argv[i]) * 1000 <= TS_HEARTBEAT_INTERVAL) )
+              error = 1;
+            else
+              config->stall_timeout = atoi(argv[i]) * 1000;
+            continue;
+
+          case 'M':
+            /* Connections of listener waiting to be served, 0 disables. */
+            if ( atoi(argv[i]) < 0 )
+              error = 1;
+            else
+              cur_socket->max_inflight = atoi(argv[i]);
+            continue;
+
+          case 'O':
+            /* Connections waiting on all listeners, 0 disables. */
+            if ( atoi(argv[i]) < 0 )
+              error = 1;
+            else
+              config->max_inflight = atoi(argv[i]);
+            continue;
+
+          case 'T':
+            /* Teardown strategy, close, wait[:ms] or reset. */
+            if ( !strcmp(argv[i], "close") )
+              cur_socket->teardown = TS_TEARDOWN_CLOSE;
+            else if ( !strcmp(argv[i], "reset") )
+              cur_socket->teardown = TS_TEARDOWN_RESET;
+            else if ( !strncmp(argv[i], "wait", 4) && (argv[i][4] == 0 || argv[i][4] == ':') ) {
+              cur_socket->teardown = TS_TEARDOWN_WAIT;
+              if ( argv[i][4] == ':' )
+                cur_socket->teardown_wait = atoi(argv[i] + 5);
+              if ( cur_socket->teardown_wait <= 0 )
+                error = 1;
+            }
+            else
+              error = 1;
+            continue;
+
+          case 'q':
+            /* Connections per second of one client, fractions allowed. */
+            if ( atof(argv[i]) < 0 || atof(argv[i]) > 1e6 )
+              error = 1;
+            else
+              config->client_rate = atof(argv[i]) * TS_RATELIMIT_SCALE;
+            continue;
+
+          case 'B':
+            if ( atof(argv[i]) < 1 || atof(argv[i]) > 1e6 )
+              error = 1;
+            else
+              config->client_burst = atof(argv[i]) * TS_RATELIMIT_SCALE;
+            continue;
+
+          case 'Z':
+            /* Kilobytes of rate limit sketch. */
+            if ( atoi(argv[i]) < 1 || atoi(argv[i]) > 1048576 )
+              error = 1;
+            else
+              config->client_memory = atoi(argv[i]) * 1024;
+            continue;
+
           case 'S':
             if (cur_socket->serve_path)
               free(cur_socket->serve_path);
@@ -141,6 +327,7 @@ int ts_configuration_parse(ts_configuration_t *config, int argc, char **argv) {
             if (cur_socket->serve_path_length == 0 || *(cur_socket->serve_path + cur_socket->serve_path_length - 1) != '/') {
               cur_socket->serve_path_length = 0;
               free(cur_socket->serve_path);
+              cur_socket->serve_path = NULL;
               error = 1;
             }
             continue;
@@ -151,6 +338,20 @@ int ts_configuration_parse(ts_configuration_t *config, int argc, char **argv) {
             cur_socket->cert_path = strdup(argv[i]);
             continue;
 
+          case 'D':
+            /* Wake up only when request data has arrived. */
+            cur_socket->defer_accept = atoi(argv[i]);
+            if ( cur_socket->defer_accept < 0 )
+              error = 1;
+            continue;
+
+          case 'F':
+            /* Accept data in SYN packet (TCP Fast Open). */
+            cur_socket->fastopen_qlen = atoi(argv[i]);
+            if ( cur_socket->fastopen_qlen < 0 )
+              error = 1;
+            continue;
+
           default:
             error = 1;
             continue;
@@ -168,14 +369,26 @@ int ts_configuration_parse(ts_configuration_t *config, int argc, char **argv) {
         free(cur_socket->ipaddr);
       cur_socket->ipaddr = strdup(argv[i]);
 
-      if ( cur_socket->port == NULL ) {
+      if ( cur_socket->port == NULL || cur_socket->ipaddr == NULL ) {
         return -1;
       }
 
+      /* Prefix like 10.0.0.0/8 is split off the address. */
+      prefix = strchr(cur_socket->ipaddr, '/');
+      if ( prefix != NULL ) {
+        *prefix++ = 0;
+        cur_socket->prefix_length = strtol(prefix, &end, 10);
+        if ( end == prefix || *end || cur_socket->prefix_length < 1 || cur_socket->prefix_length > 128 ) {
+          error = 1;
+          continue;
+        }
+      }
+
       if ( cur_socket->cert_path == NULL )
-        cur_socket->options &= ~DO_SSL;
+        cur_socket->options &= ~(DO_SSL | DO_DETECT);
 
-      /* Update global configuration list */
+      /* Update global configuration list, the first listener has the highest index. */
+      cur_socket->index = ( config->sock ) ? config->sock->index + 1 : 0;
       cur_socket->next = config->sock;
       config->sock = cur_socket;
 
@@ -190,9 +403,19 @@ int ts_configuration_parse(ts_configuration_t *config, int argc, char **argv) {
     return -1;
   }
 
+  /* Client may open a second of its rate at once by default. */
+  if ( config->client_burst == 0 )
+    config->client_burst = config->client_rate;
+
+  /* Pool grows from -w workers up to -W workers. */
+  if ( config->max_workers < config->workers )
+    config->max_workers = config->workers;
+
   if ( config->sock == NULL ) {
     if ( cur_socket->port == NULL )
       cur_socket->port = strdup(DEFAULT_PORT);
+    if ( cur_socket->cert_path == NULL )
+      cur_socket->options &= ~(DO_SSL | DO_DETECT);
     cur_socket->next = NULL;
     config->sock = cur_socket;
   }
@@ -218,6 +441,14 @@ void ts_configuration_free(ts_configuration_t *config) {
       free(config->user);
     if ( config->pidfile != NULL )
       free(config->pidfile);
+    if ( config->stats_name != NULL )
+      free(config->stats_name);
+    if ( config->access_log != NULL )
+      free(config->access_log);
+    if ( config->cpus != NULL )
+      free(config->cpus);
+    if ( config->nic != NULL )
+      free(config->nic);
     free(config);
   }
 }
@@ -3,21 +3,55 @@
 
 #include "project.h"
 
+#include <sys/socket.h> /* struct sockaddr_storage, socklen_t */
+
 enum ts_socket_option {
   DO_204 = 1,
   DO_CLOSE = 1 << 1,
   DO_REDIRECT = 1 << 2,
-  DO_SSL = 1 << 3
+  DO_SSL = 1 << 3,
+  DO_STATS = 1 << 4,
+  DO_ADMIN = 1 << 5,
+  DO_RESET = 1 << 6,
+  /* TLS or plain HTTP chosen by first byte of every connection. */
+  DO_DETECT = 1 << 7
+};
+
+/* How connection is closed once response was sent. */
+enum ts_teardown {
+  /* Server closes first, its side of connection stays in TIME_WAIT. */
+  TS_TEARDOWN_CLOSE,
+  /* Wait for client to close first until deadline. */
+  TS_TEARDOWN_WAIT,
+  /* Reset after canned responses, nothing is left behind. */
+  TS_TEARDOWN_RESET
 };
 
 struct ts_socket {
-  int sockfd;
+  /* Resolved address of listener. */
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  /* Listening socket of every worker, created by the supervisor, -1 for workers not running. */
+  int *sockfds;
   char* ipaddr;
+  /* Listener takes connections to any address of prefix of this length (IP_TRANSPARENT), 0 for one address. */
+  int prefix_length;
   char* port;
   unsigned int options;
   unsigned int serve_path_length;
   char *serve_path;
   char *cert_path;
+  /* Seconds to wait for request data before accept() (TCP_DEFER_ACCEPT), 0 disables. */
+  int defer_accept;
+  /* Queue length for TCP Fast Open, 0 disables. */
+  int fastopen_qlen;
+  /* Connections waiting to be served over this many are shed, 0 disables. */
+  unsigned int max_inflight;
+  enum ts_teardown teardown;
+  /* Milliseconds to wait for client to close with TS_TEARDOWN_WAIT. */
+  int teardown_wait;
+  /* Position among listeners, indexes their state kept by every worker. */
+  unsigned int index;
   struct ts_socket *next;
 };
 
@@ -26,6 +60,37 @@ typedef struct ts_socket ts_socket_t;
 struct ts_configuration {
   char *user;
   char *pidfile;
+  /* Name of shared memory segment with statistics. */
+  char *stats_name;
+  /* Workers started, and upper bound the pool may grow to with load. */
+  unsigned int workers;
+  unsigned int max_workers;
+  /* Milliseconds without heartbeat before a worker is replaced, 0 disables. */
+  long long stall_timeout;
+  /* Cap of connections waiting on all listeners together, 0 disables. */
+  unsigned int max_inflight;
+  /* Connections per second and burst allowed to one client address, in thousandths, 0 disables. */
+  unsigned int client_rate;
+  unsigned int client_burst;
+  /* Bytes of rate limit sketch of every worker. */
+  unsigned int client_memory;
+  char *access_log;
+  /* Log every n-th request. */
+  unsigned int log_sample;
+  /* Rotate access log when it grows over this size in bytes, 0 disables. */
+  long long log_rotate_size;
+  /* CPU list of workers, and network device whose CPUs are preferred. */
+  char *cpus;
+  char *nic;
+  /* Set SO_INCOMING_CPU of worker sockets to CPU of worker. */
+  int incoming_cpu;
+  /* Attach reuseport program choosing socket of worker on receiving CPU. */
+  int steer_cpu;
+  /* All workers accept from one socket per listener. */
+  int shared_listen;
+  /* Workers are threads of one process, woken up for termination by wakefd. */
+  int threads;
+  int wakefd;
   int do_foreground;
   int log_option;
   struct passwd *pw;
@@ -34,6 +99,16 @@ struct ts_configuration {
 
 typedef struct ts_configuration ts_configuration_t;
 
+struct ts_worker {
+  /* Index of statistics slot. */
+  unsigned int index;
+  /* CPU the worker is pinned to, -1 when not pinned. */
+  int cpu;
+  ts_configuration_t *config;
+};
+
+typedef struct ts_worker ts_worker_t;
+
 ts_configuration_t *ts_configuration_create(void);
 int ts_configuration_parse(ts_configuration_t *, int, char **);
 void ts_configuration_free(ts_configuration_t *);
@@ -1,47 +1,95 @@
 #include "connection.h"
+#include "accesslog.h"
+#include "cache.h"
+#include "epoch.h"
 #include "mime.h"
 #include "utils.h"
 #include "ssl.h"
+#include "stats.h"
+#include "teardown.h"
+#include "probes.h"
+#include "trace.h"
 
 #include <arpa/inet.h>	/* recv(), send(), SOL_SOCKET */
 #include <errno.h> /* errno */
-#include <fcntl.h> /* O_RDONLY */
+#include <fcntl.h> /* O_NONBLOCK, O_RDONLY */
+#include <stdint.h> /* uintptr_t */
+#include <poll.h> /* poll() */
 #include <netinet/tcp.h> /* TCP_CORK */
 #include <stdio.h>
-#include <stdlib.h> /* free(), malloc() */
+#include <stdlib.h> /* calloc(), malloc(), free() */
 #include <string.h> /* strcasestr() */
+#include <linux/sockios.h> /* SIOCOUTQ */
+#include <sys/epoll.h> /* epoll_ctl() */
+#include <sys/ioctl.h> /* ioctl() */
 #include <sys/sendfile.h> /* sendfile() */
 #include <sys/stat.h> /* struct stat */
-#include <unistd.h> /* close() */
+#include <sys/uio.h> /* struct iovec */
+#include <syslog.h>
+#include <time.h> /* clock_gettime() */
+#include <unistd.h> /* close(), pread() */
 
-static const mime_t *get_mime(char *ext) {
+TS_PROBE_SEMAPHORE(serve);
 
-  const mime_t *ar_mimes;
-  unsigned int i;
+static void connection_file_release(void *ptr) {
 
-  if ( ext && *ext == '.' ) {
+  close((int)(intptr_t)ptr);
+}
 
-    /* Skip the dot and compare only characters. */
-    ext++;
+/* Open descriptors of served files, shared by all workers of a process. */
+static ts_cache_t connection_files = TS_CACHE_INITIALIZER(TS_FILE_CACHE_SIZE, connection_file_release);
 
-    /* Load first mime from array. */
-    i = 0;
-    ar_mimes = &default_mimes[0];
+/*
+Open file through the cache. File is checked with stat() at most once per
+TS_FILE_CACHE_VALID milliseconds. Returns descriptor, or -1 when file is
+missing, *shared tells whether the descriptor belongs to the cache.
+*/
+static int connection_file_open(const char *file, off_t *size, int *shared) {
 
-    while ( ar_mimes[i].ext ) {
-      if ( !strncasecmp(ext, ar_mimes[i].ext, ar_mimes[i].ext_len) ) {
-        return &ar_mimes[i];
-      }
-      i++;
-    }
+  ts_cache_entry_t *entry;
+  struct stat st;
+  long long now;
+  int fd;
 
-    /* Return last mime: SEND_UNK_EXT. */
-    return &ar_mimes[i];
+  now = ts_clock_ms();
+  entry = ts_cache_find(&connection_files, file);
+  if ( entry && now - __atomic_load_n(&entry->checked, __ATOMIC_RELAXED) < TS_FILE_CACHE_VALID ) {
+    *size = entry->size;
+    *shared = 1;
+    return (int)(intptr_t)entry->value;
+  }
 
+  if ( stat(file, &st) < 0 || (st.st_mode & S_IFMT) != S_IFREG )
+    return -1;
+
+  if ( entry && ts_cache_valid(entry, &st) ) {
+    __atomic_store_n(&entry->checked, now, __ATOMIC_RELAXED);
+    *size = entry->size;
+    *shared = 1;
+    return (int)(intptr_t)entry->value;
   }
 
-  /* Return no mime: SENT_NO_EXT. */
-  return &no_mime;
+  fd = open(file, O_RDONLY | O_CLOEXEC);
+  if ( fd < 0 )
+    return -1;
+
+  *size = st.st_size;
+  *shared = ( ts_cache_insert(&connection_files, file, &st, (void *)(intptr_t)fd) != NULL );
+  return fd;
+}
+
+/* Called by a worker on reload, connections keep descriptors they hold until they finish. */
+void connection_files_clear(void) {
+
+  ts_cache_clear(&connection_files);
+}
+
+static void connection_file_close(ps_connection_t *connection) {
+
+  if ( connection->filefd && !connection->fileshared )
+    close(connection->filefd);
+  connection->filefd = 0;
+  connection->fileshared = 0;
 }
 
 static int handle_file(ps_connection_t *connection, ts_socket_t *sock, const char *filename) {
@@ -49,8 +97,8 @@ static int handle_file(ps_connection_t *connection, ts_socket_t *sock, const cha
   char file[MAX_PATH_LENGTH];
   char *hostname;
   unsigned int hostname_length, filename_length, length;
-  int fd;
-  struct stat st;
+  int fd, shared;
+  off_t size;
 
   if ( *(filename + 1) == 0 )
     return -1;
@@ -58,10 +106,8 @@ static int handle_file(ps_connection_t *connection, ts_socket_t *sock, const cha
   hostname = http_header_getvalue(connection->request, HEADER_HOSTNAME);
   if ( hostname == NULL )
     return -1;
-  if ( strchr(hostname, '/' ) != NULL || *hostname == '.' || *hostname == 0 ) {
-    free(hostname);
+  if ( strchr(hostname, '/' ) != NULL || *hostname == '.' || *hostname == 0 )
     return -1;
-  }
 
   hostname_length = find_delimiter(hostname, NULL, ":");
   if ( hostname_length > 0 ) {
@@ -72,7 +118,6 @@ static int handle_file(ps_connection_t *connection, ts_socket_t *sock, const cha
     hostname_length = strlen(hostname);
 
   if ( change_dots_to_underscore(hostname) < 0 ) {
-    free(hostname);
     connection->response->status_code = 400;
     return -1;
   }
@@ -102,28 +147,27 @@ static int handle_file(ps_connection_t *connection, ts_socket_t *sock, const cha
   strcat(file, hostname);
   strcat(file, filename);
 
-  free(hostname);
-
   DEBUG_PRINT("Requested local file: %s", file);
 
   /* Check if file exists and it is a regular file. */
-  fd = 0;
-  if ( stat(file, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG ) {
-    connection->length = st.st_size;
-    fd = open(file, O_RDONLY);
-  }
+  fd = connection_file_open(file, &size, &shared);
 
-  if ( fd ) {
+  if ( fd >= 0 ) {
+    connection->length = size;
     connection->response->status_code = 200;
+    connection->response_type = SEND_FILE;
     switch ( connection->request->method ) {
       case HTTP_METHOD_GET:
         connection->filefd = fd;
+        connection->fileshared = shared;
         return 0;
       case HTTP_METHOD_HEAD:
-        close(fd);
+        if ( !shared )
+          close(fd);
         return 0;
       default:
-        close(fd);
+        if ( !shared )
+          close(fd);
     }
     connection->response->status_code = 501;
     return -1;
@@ -137,7 +181,6 @@ static int handle_file(ps_connection_t *connection, ts_socket_t *sock, const cha
 static int handle_redirect(ps_connection_t *connection) {
 
   char *query, *referer, *url;
-  char *decoded_query;
 
   query = connection->request->query;
   if ( *query == 0 )
@@ -145,37 +188,25 @@ static int handle_redirect(ps_connection_t *connection) {
 
   DEBUG_PRINT("Query: %s.", query);
 
-  if ( !strcasestr(query, "=http") && !strcasestr(query, "\x3dhttp") && !strcasestr(query, "%5Cx3dhttp") )
-    return -1;
-
-   /* Decoded string could be shorter, but +1 for termination. */
-  decoded_query = malloc((strlen(query) + 1) * sizeof(char));
-  decode_url(decoded_query, query);
-
-  /* Double decode */
-  decode_url(decoded_query, decoded_query);
-
-  url = strstr_last(decoded_query, "http://");
-  if ( url == NULL ) {
-    url = strstr_last(decoded_query, "https://");
-  }
+  /* Query is decoded in place, it is not used after this point. */
+  url = find_redirect_url(query);
 
   if ( url ) {
     referer = http_header_getvalue(connection->request, HEADER_REFERER);
     if ( referer != NULL ) {
       if ( strstr(referer, url) && !strstr(referer, "adurl") )
         url = NULL;
-      free(referer);
     }
   }
 
   if ( url ) {
     http_header_setvalue(connection->response, HEADER_LOCATION, url);
     connection->response->status_code = 307;
+    /* Known length lets client close first, before server does. */
+    connection->length = 0;
+    connection->response_type = SEND_REDIRECT;
   }
 
-  free(decoded_query);
-
   return ( url ) ? 0 : -1;
 }
 
@@ -195,7 +226,6 @@ static int handle_jsclose(ps_connection_t *connection, const mime_t *mime) {
     if ( accept != NULL ) {
       if ( strcmp(accept, "\x2A\x2F\x2A") ) /*  * / *  */
         cont = 1;
-      free(accept);
     }
   }
 
@@ -207,6 +237,34 @@ static int handle_jsclose(ps_connection_t *connection, const mime_t *mime) {
   connection->length = sizeof(content_jsclose) - 1;
   if ( connection->request->method == HTTP_METHOD_GET )
     connection->str = content_jsclose;
+  connection->response_type = SEND_JSCLOSE;
+  return 0;
+}
+
+static int handle_stats(ps_connection_t *connection) {
+
+  ts_stats_t *total;
+  char *buf;
+  int length;
+
+  buf = ts_arena_alloc(connection->arena, TS_STATS_BUFFER_SIZE + sizeof(ts_stats_t) + TS_CACHE_LINE);
+  if ( buf == NULL )
+    return -1;
+
+  /* Sum of all workers is kept in arena behind output buffer. */
+  total = (ts_stats_t *)(((uintptr_t)buf + TS_STATS_BUFFER_SIZE + TS_CACHE_LINE - 1) & ~(uintptr_t)(TS_CACHE_LINE - 1));
+  ts_stats_aggregate(total);
+
+  length = ts_stats_format(total, buf, TS_STATS_BUFFER_SIZE);
+  if ( length < 0 )
+    return -1;
+
+  http_header_setvalue(connection->response, HEADER_CONTENT_TYPE, "text/plain; version=0.0.4");
+  connection->response->status_code = 200;
+  connection->length = length;
+  if ( connection->request->method == HTTP_METHOD_GET )
+    connection->str = buf;
+  connection->response_type = SEND_STATS;
   return 0;
 }
 
@@ -214,6 +272,7 @@ static int serve(ps_connection_t *connection, ts_socket_t *sock, int *error) {
 
   char *filename, *ext;
   const mime_t *mime;
+  int rv;
 
   if ( connection->request->method != HTTP_METHOD_GET && connection->request->method != HTTP_METHOD_HEAD ) {
     *error = 501;
@@ -226,32 +285,55 @@ static int serve(ps_connection_t *connection, ts_socket_t *sock, int *error) {
     return -1;
   }
 
+  /* Host header is looked up only for an attached tracer. */
+  TS_PROBE3_GUARDED(serve, connection->fd, http_header_getvalue(connection->request, HEADER_HOSTNAME), filename);
+
+  if ( (sock->options & DO_ADMIN) || ((sock->options & DO_STATS) && !strcmp(filename, TS_STATS_URL)) ) {
+    if ( !handle_stats(connection) )
+      return 0;
+    *error = 500;
+    return -1;
+  }
+
   ext = strrchr(filename, '.');
   mime = get_mime(ext);
 
   http_header_setvalue(connection->response, HEADER_CONTENT_TYPE, mime->typestr);
 
   if ( sock->serve_path_length > 0 && is_safe_filename(filename) ) {
-    if ( !handle_file(connection, sock, filename) )
+    TRACE_BEGIN(trace_file);
+    rv = handle_file(connection, sock, filename);
+    TRACE_END(TRACE_FILE, trace_file);
+    if ( !rv )
       return 0;
   }
 
   if ( sock->options & DO_204 ) {
+    TRACE_BEGIN(trace_204);
     /* HTTP 204 No Content for Google generate_204 URLs. */
-    if ( !strcasecmp(filename, "/generate_204") || !strcasecmp(filename, "/gen_204") ) {
+    rv = strcasecmp(filename, "/generate_204") && strcasecmp(filename, "/gen_204");
+    TRACE_END(TRACE_204, trace_204);
+    if ( !rv ) {
       connection->response->status_code = 204;
+      connection->response_type = SEND_204;
       return 0;
     }
   }
 
   if ( sock->options & DO_REDIRECT ) {
+    TRACE_BEGIN(trace_redirect);
     /* HTTP 307 Temporary Redirect for click counters. */
-    if ( !handle_redirect(connection) )
+    rv = handle_redirect(connection);
+    TRACE_END(TRACE_REDIRECT, trace_redirect);
+    if ( !rv )
       return 0;
   }
 
   if ( sock->options & DO_CLOSE ) {
-    if ( !handle_jsclose(connection, mime) )
+    TRACE_BEGIN(trace_jsclose);
+    rv = handle_jsclose(connection, mime);
+    TRACE_END(TRACE_JSCLOSE, trace_jsclose);
+    if ( !rv )
       return 0;
   }
 
@@ -265,24 +347,51 @@ static int serve(ps_connection_t *connection, ts_socket_t *sock, int *error) {
     connection->length = 0;
   }
   connection->response->status_code = 200;
+  connection->response_type = mime->response_type;
 
   return 0;
 }
 
-static int connection_read(ts_socket_t *sock, struct ts_ssl *ssl, int fd, char *buf, int buflen) {
+/*
+First byte of connection on listener with -d tells TLS record (handshake 0x16)
+from HTTP method. It is peeked, so TLS library or recv() read it again from the
+socket, and waits no longer than the read which follows would.
+*/
+static int connection_detect(int fd) {
 
 #ifdef USE_SSL
+  unsigned char first;
+
+  if ( recv(fd, &first, 1, MSG_PEEK) == 1 && first == 0x16 )
+    return 1;
+#else
+  (void)fd;
+#endif /* USE_SSL */
+
+  return 0;
+}
+
+static int connection_read(ts_socket_t *sock, struct ts_ssl *ssl, ps_connection_t *connection, char *buf, int buflen) {
+
   int rv;
 
-  if ( sock->options & DO_SSL ) {
+#ifdef USE_SSL
+  if ( connection->tls ) {
 
     ssl->cert_path = sock->cert_path;
 
-    rv = ts_ssl_session_init(ssl, fd);
-    if ( rv > 0 )
-      return SSL_read(ssl->s, buf, buflen);
-    else
-      return -1;
+    TRACE_BEGIN(trace_handshake);
+    rv = ts_ssl_session_init(ssl, connection->fd);
+    TRACE_END(TRACE_TLS_HANDSHAKE, trace_handshake);
+    if ( rv > 0 ) {
+      TS_STATS_INC(tls_handshakes);
+      TRACE_BEGIN(trace_read);
+      rv = SSL_read(ssl->s, buf, buflen);
+      TRACE_END(TRACE_READ, trace_read);
+      return rv;
+    }
+    TS_STATS_INC(tls_handshake_failures);
+    return -1;
 
   }
 #else
@@ -290,112 +399,731 @@ static int connection_read(ts_socket_t *sock, struct ts_ssl *ssl, int fd, char *
   (void)ssl;
 #endif /* USE_SSL */
 
-  return recv(fd, buf, buflen, 0);
+  TRACE_BEGIN(trace_read);
+  rv = recv(connection->fd, buf, buflen, 0);
+  TRACE_END(TRACE_READ, trace_read);
+  return rv;
 }
 
-static int connection_write(ts_socket_t *sock, struct ts_ssl *ssl, int fd, ps_connection_t *connection) {
+static int connection_prepare(int fd, ps_connection_t *connection) {
 
-  char response_buffer[CHAR_BUF_SIZE];
-  int response_buffer_size;
-  int size;
   char content_length[11];
-  off_t offset;
-  int flags;
-
-#ifndef USE_SSL
-  (void)sock;
-  (void)ssl;
-#endif /* USE_SSL */
+  int yes;
 
   if ( connection->length > -1 ) {
     sprintf(content_length, "%d", connection->length);
     http_header_setvalue(connection->response, HEADER_CONTENT_LENGTH, content_length);
   }
 
-  flags = MSG_NOSIGNAL;
-  if ( connection->length > 0 )
-    flags |= MSG_MORE;
-
   /* Output header. */
-  response_buffer_size = http_header_fill(connection->response, response_buffer, sizeof(response_buffer) - 1);
-  DEBUG_PRINT("Header length: %d.", response_buffer_size);
-  if ( response_buffer_size < 0 )
+  connection->buffer_length = http_header_fill(connection->response, connection->buffer, sizeof(connection->buffer) - 1);
+  DEBUG_PRINT("Header length: %d.", connection->buffer_length);
+  if ( connection->buffer_length < 0 )
     return -1;
 
+  connection->offset = 0;
+
+  /* Small files are read right behind the header, so they go out together. */
+  if ( connection->filefd && connection->length <= (int)sizeof(connection->buffer) - connection->buffer_length ) {
+    if ( pread(connection->filefd, connection->buffer + connection->buffer_length, connection->length, 0) == connection->length ) {
+      connection->buffer_length += connection->length;
+      connection_file_close(connection);
+    }
+  }
+
+  /* Put constant buffer into the same TLS record as header if possible. */
+  if ( connection->tls && connection->str &&
+       connection->length <= (int)sizeof(connection->buffer) - connection->buffer_length ) {
+    memcpy(connection->buffer + connection->buffer_length, connection->str, connection->length);
+    connection->buffer_length += connection->length;
+    connection->str = NULL;
+  }
+
+  /* Large file is sent by kernel, header is held back until the first file data are queued. */
+  if ( connection->filefd && !connection->tls ) {
+    yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, (void *)&yes, sizeof(yes));
+    connection->corked = 1;
+  }
+
+  return 0;
+}
+
+static int connection_write_plain(int fd, ps_connection_t *connection) {
+
+  struct iovec iov[2];
+  struct msghdr msg;
+  off_t body_offset;
+  int rv;
+
+  connection->events = POLLOUT;
+
+  if ( connection->offset < connection->buffer_length ) {
+    /* Output header and constant body with single call. */
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    iov[0].iov_base = connection->buffer + connection->offset;
+    iov[0].iov_len = connection->buffer_length - connection->offset;
+    if ( connection->str && connection->length > 0 ) {
+      iov[1].iov_base = (void *)connection->str;
+      iov[1].iov_len = connection->length;
+      msg.msg_iovlen = 2;
+    }
+    rv = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | (connection->filefd ? MSG_MORE : 0));
+  }
+  else {
+    body_offset = connection->offset - connection->buffer_length;
+    if ( connection->str )
+      rv = send(fd, connection->str + body_offset, connection->length - body_offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+    else {
+      /* Output file hander content. */
+      rv = sendfile(fd, connection->filefd, &body_offset, connection->length - body_offset);
+      if ( rv == 0 )
+        /* File was truncated meanwhile. */
+        return -1;
+    }
+  }
+
+  if ( rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+    return 0;
+
+  return rv;
+}
+
 #ifdef USE_SSL
-  if ( sock->options & DO_SSL )
-    size = SSL_write(ssl->s, response_buffer, response_buffer_size);
-  else
+static int connection_write_ssl(struct ts_ssl *ssl, ps_connection_t *connection) {
+
+  off_t body_offset;
+  int rv;
+
+  if ( connection->offset < connection->buffer_length )
+    rv = SSL_write(ssl->s, connection->buffer + connection->offset, connection->buffer_length - connection->offset);
+  else {
+    body_offset = connection->offset - connection->buffer_length;
+    if ( connection->str )
+      rv = SSL_write(ssl->s, connection->str + body_offset, connection->length - body_offset);
+    else
+      rv = ts_ssl_sendfile(ssl->s, connection->filefd, body_offset, connection->length - body_offset);
+  }
+
+  if ( rv > 0 )
+    return rv;
+
+  connection->events = ts_ssl_want(ssl->s, rv);
+  return ( connection->events ) ? 0 : -1;
+}
+#endif /* USE_SSL */
+
+/*
+Write as much of the response as socket accepts, continuing from the current offset.
+Returns 1 when the whole response was written, 0 when socket is not ready
+(connection->events tells what to wait for) and -1 on error.
+*/
+static int connection_write(struct ts_ssl *ssl, int fd, ps_connection_t *connection) {
+
+  off_t total;
+  int rv;
+
+#ifndef USE_SSL
+  (void)ssl;
 #endif /* USE_SSL */
-    size = send(fd, response_buffer, response_buffer_size, flags);
 
-  if ( connection->filefd ) {
+  total = connection->buffer_length;
+  if ( connection->str || connection->filefd )
+    total += connection->length;
+
+  while ( connection->offset < total ) {
 
 #ifdef USE_SSL
-    if ( sock->options & DO_SSL ) {
-      ts_ssl_sendfile(ssl->s, connection->filefd, connection->length);
-    }
+    if ( connection->tls )
+      rv = connection_write_ssl(ssl, connection);
     else
 #endif /* USE_SSL */
-    {
-      /* Output file hander content. */
-      offset = 0;
-      size += sendfile(fd, connection->filefd, &offset, connection->length);
+      rv = connection_write_plain(fd, connection);
+
+    TS_PROBE3(write, fd, connection->offset, rv);
+
+    if ( rv <= 0 )
+      return rv;
+
+    connection->offset += rv;
+  }
+
+  return 1;
+}
+
+/*
+Response may take TS_WRITE_TIMEOUT, and longer only as long as the client reads
+at least TS_WRITE_MIN_RATE. Trickling reader cannot hold the connection forever.
+*/
+static long long connection_write_deadline(long long started, off_t offset) {
+
+  return started + TS_WRITE_TIMEOUT + offset / TS_WRITE_MIN_RATE;
+}
+
+/* Write once as much as socket takes, first byte is timed. Returns as connection_write(). */
+static int connection_write_timed(struct ts_ssl *ssl, int fd, ps_connection_t *connection) {
+
+  off_t offset;
+  int rv;
+
+  offset = connection->offset;
+  rv = connection_write(ssl, fd, connection);
+  if ( offset == 0 && connection->offset > 0 )
+    ts_histogram_record(&ts_stats->first_byte_latency, (ts_clock_ns() - connection->accepted) / 1000);
+  return rv;
+}
+
+/* Whole response was written, or it failed. */
+static void connection_write_end(int fd, ps_connection_t *connection) {
+
+  int no;
+
+  if ( connection->corked ) {
+    no = 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, (void *)&no, sizeof(no));
+    connection->corked = 0;
+  }
+
+  connection_file_close(connection);
+}
+
+/*
+Write as much of response as socket takes without waiting. Returns 0 when the
+rest waits for the client, the write is then not ended yet.
+*/
+static int connection_send(struct ts_ssl *ssl, int fd, ps_connection_t *connection) {
+
+  int rv;
+
+  /* From now on we don't block in send(), but wait for socket with a deadline. */
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  rv = connection_write_timed(ssl, fd, connection);
+  if ( rv != 0 )
+    connection_write_end(fd, connection);
+  return rv;
+}
+
+/* Rest of response is written by blocking the worker, when event loop cannot take it. */
+static int connection_flush(struct ts_ssl *ssl, int fd, ps_connection_t *connection) {
+
+  struct pollfd pfd;
+  long long started, deadline, now;
+  off_t offset;
+  int rv;
+
+  started = ts_clock_ms();
+  deadline = connection_write_deadline(started, 0);
+  for (;;) {
+
+    offset = connection->offset;
+    rv = connection_write_timed(ssl, fd, connection);
+    if ( rv != 0 )
+      break;
+
+    /* Deadline is moved only by what client has received, worker does not beat meanwhile. */
+    now = ts_clock_ms();
+    if ( connection->offset != offset )
+      deadline = connection_write_deadline(started, connection->offset);
+    if ( now >= deadline ) {
+      DEBUG_PRINT("Write timeout on socket %d after %ld bytes.", fd, (long)connection->offset);
+      rv = -1;
+      break;
     }
 
-    close(connection->filefd);
+    pfd.fd = fd;
+    pfd.events = connection->events;
+    if ( poll(&pfd, 1, (int)(deadline - now)) < 0 && errno != EINTR ) {
+      rv = -1;
+      break;
+    }
   }
-  else if ( connection->str ) {
+
+  connection_write_end(fd, connection);
+
+  return rv;
+}
+
+/* Fill log record from request, which is gone by the time the connection is done. */
+static void connection_log_prepare(ps_connection_t *connection, ts_log_record_t *record) {
+
+  char *host;
+
+  memset(record->addr, 0, sizeof(record->addr));
+  memset(record->server, 0, sizeof(record->server));
+  ts_log_address(record, connection->peer, &connection->local);
+
+  record->response_type = connection->response_type;
+  record->status = connection->response->status_code;
+
+  record->path_hash = ( connection->request->filename ) ? ts_log_hash(connection->request->filename) : 0;
+
+  host = http_header_getvalue(connection->request, HEADER_HOSTNAME);
+  record->host[0] = 0;
+  if ( host ) {
+    strncpy(record->host, host, sizeof(record->host) - 1);
+    record->host[sizeof(record->host) - 1] = 0;
+  }
+}
+
+static void connection_log(ps_connection_t *connection, ts_log_record_t *record, long long latency) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  record->timestamp = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  record->bytes = connection->offset;
+  record->latency = latency;
+
+  ts_log_push(record);
+}
+
+/*
+Refuse connection over the cap or over the rate of its client without reading
+its request. Plain listeners answer with precomputed 503 or 429 given by
+status, TLS listeners and those with -X reset it.
+*/
+void connection_shed(ts_socket_t *sock, int fd, int status) {
+
+  struct linger linger;
+  const char *content;
+  size_t length;
+
+  if ( status == 429 ) {
+    content = content_limited;
+    length = sizeof(content_limited) - 1;
+    TS_STATS_INC(connections_limited);
+  }
+  else {
+    content = content_shed;
+    length = sizeof(content_shed) - 1;
+    TS_STATS_INC(connections_shed);
+  }
+
+  if ( sock->options & (DO_SSL | DO_DETECT | DO_RESET) ) {
+    /* Reset frees the connection at once, without TIME_WAIT. */
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  }
+  else {
+    /* Unread request would turn close into reset which may discard the response. */
+    recv(fd, NULL, CHAR_BUF_SIZE, MSG_DONTWAIT | MSG_TRUNC);
+    if ( send(fd, content, length, MSG_DONTWAIT | MSG_NOSIGNAL) > 0 )
+      ts_stats_status(status);
+  }
+  close(fd);
+}
+
+/*
+Close connection by teardown strategy of listener. Side which closes first
+keeps connection in TIME_WAIT, so server lets client close first, or resets
+connections after canned responses once client acknowledged all of it, data
+still in flight could not be retransmitted after reset. Files and statistics
+are always closed normally, reset could discard them at the client.
+*/
+static void connection_close(ts_socket_t *sock, int fd, ps_connection_t *connection) {
+
+  struct linger linger;
+  int unacked;
+
+  if ( sock->teardown == TS_TEARDOWN_RESET &&
+       connection->response_type != SEND_FILE && connection->response_type != SEND_STATS &&
+       ioctl(fd, SIOCOUTQ, &unacked) == 0 && unacked == 0 ) {
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    if ( setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)) == 0 ) {
+      close(fd);
+      TS_STATS_INC(closes[TS_CLOSE_RESET]);
+      return;
+    }
+  }
+
+  /* Client closes once it has read the response, event loop of worker waits for it. */
+  if ( sock->teardown == TS_TEARDOWN_WAIT && ts_teardown_start(fd, sock->teardown_wait, TS_CLOSE_CLIENT) == 0 )
+    return;
+
+  /* Request body still arriving would turn close into reset, which may discard the response. */
+  if ( connection->linger ) {
+    shutdown(fd, SHUT_WR);
+    if ( ts_teardown_start(fd, sock->teardown_wait, TS_CLOSE_SERVER) == 0 )
+      return;
+  }
+
+  TS_STATS_INC(closes[TS_CLOSE_SERVER]);
+  shutdown(fd, SHUT_RDWR);
+  close(fd);
+}
+
+/* Blocking reads of request wait at most a second. */
+static int connection_timeout(int fd) {
+
+  struct timeval timeout;
+
+  timeout.tv_sec = 1;
+  timeout.tv_usec = 0;
+  return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(struct timeval));
+}
+
+/*
+Response is over, connection is closed, counted and logged. Record is NULL
+when access log is off.
+*/
+static void connection_done(ts_socket_t *sock, int fd, ps_connection_t *connection, struct ts_ssl *ssl,
+                            int status, ts_log_record_t *record) {
+
+  long long latency;
+
+  TS_STATS_ADD(bytes_sent, connection->offset);
+
+  TRACE_BEGIN(trace_close);
+
 #ifdef USE_SSL
-    /* Output constant buffer. */
-    if ( sock->options & DO_SSL )
-      size += SSL_write(ssl->s, connection->str, connection->length);
+  if ( connection->tls ) {
+    DEBUG_PRINT("Closing down ssl");
+    ts_ssl_session_close(ssl);
+  }
+#else
+  (void)ssl;
+#endif
+
+  connection_close(sock, fd, connection);
+
+  TRACE_END(TRACE_CLOSE, trace_close);
+
+  latency = (ts_clock_ns() - connection->accepted) / 1000;
+  TS_PROBE4(connection_done, fd, status, connection->offset, latency);
+  ts_histogram_record(&ts_stats->request_latency, latency);
+  if ( record )
+    connection_log(connection, record, latency);
+
+  TS_STATS_ADD(connections_active, -1);
+}
+
+/*
+Slots of worker. Free ones are linked through next, those in use from head to
+tail in order of deadlines. Slots are large, they are taken from the untouched
+end of the table only when none was freed.
+*/
+static __thread ts_connection_write_t *connection_writes = NULL;
+static __thread unsigned int connection_writes_used;
+static __thread ts_connection_write_t *connection_writes_free;
+static __thread ts_connection_write_t *connection_writes_head;
+static __thread ts_connection_write_t *connection_writes_tail;
+static __thread int connection_writes_epfd;
+
+/* Allocate slots of worker whose sockets are registered with epfd. */
+int connection_writes_init(int epfd) {
+
+  connection_writes = calloc(TS_WRITES_MAX, sizeof(ts_connection_write_t));
+  if ( connection_writes == NULL ) {
+    syslog(LOG_WARNING, "Cannot allocate pending writes, responses are written by blocking the worker.");
+    return -1;
+  }
+
+  connection_writes_used = 0;
+  connection_writes_free = NULL;
+  connection_writes_head = NULL;
+  connection_writes_tail = NULL;
+  connection_writes_epfd = epfd;
+
+  return 0;
+}
+
+/* Event data of epoll point to slot of write. */
+int connection_writes_owns(const void *ptr) {
+
+  return connection_writes != NULL &&
+    (const ts_connection_write_t *)ptr >= connection_writes &&
+    (const ts_connection_write_t *)ptr < connection_writes + TS_WRITES_MAX;
+}
+
+/* Slot is linked by its deadline, which is usually the last one. */
+static void connection_writes_link(ts_connection_write_t *write) {
+
+  ts_connection_write_t *cur;
+
+  for ( cur = connection_writes_tail; cur && cur->deadline > write->deadline; cur = cur->prev );
+  write->prev = cur;
+  write->next = ( cur ) ? cur->next : connection_writes_head;
+  if ( write->next )
+    write->next->prev = write;
+  else
+    connection_writes_tail = write;
+  if ( cur )
+    cur->next = write;
+  else
+    connection_writes_head = write;
+}
+
+static void connection_writes_unlink(ts_connection_write_t *write) {
+
+  if ( write->prev )
+    write->prev->next = write->next;
+  else
+    connection_writes_head = write->next;
+  if ( write->next )
+    write->next->prev = write->prev;
+  else
+    connection_writes_tail = write->prev;
+}
+
+/* Write is over, connection is done and its slot is free again. */
+static void connection_writes_finish(ts_connection_write_t *write) {
+
+  ps_connection_t *connection;
+
+  connection = &write->connection;
+  epoll_ctl(connection_writes_epfd, EPOLL_CTL_DEL, connection->fd, NULL);
+  connection_writes_unlink(write);
+
+  connection_write_end(connection->fd, connection);
+  free(write->body);
+  write->body = NULL;
+  connection_done(write->sock, connection->fd, connection, &write->ssl, write->status,
+                  ts_log_enabled() ? &write->record : NULL);
+
+  write->next = connection_writes_free;
+  connection_writes_free = write;
+}
+
+/* Socket is watched for what the write waits for, TLS may need to read. */
+static int connection_writes_wait(ts_connection_write_t *write, int op) {
+
+  struct epoll_event event;
+
+  event.events = ( write->connection.events == POLLIN ) ? EPOLLIN : EPOLLOUT;
+  if ( op == EPOLL_CTL_MOD && event.events == write->events )
+    return 0;
+  event.data.ptr = write;
+  if ( epoll_ctl(connection_writes_epfd, op, write->connection.fd, &event) < 0 )
+    return -1;
+  write->events = event.events;
+  return 0;
+}
+
+/* Write what the socket takes now, the deadline moves by what client has received. */
+void connection_writes_event(void *ptr) {
+
+  ts_connection_write_t *write;
+  off_t offset;
+  int rv;
+
+  write = (ts_connection_write_t *)ptr;
+
+  offset = write->connection.offset;
+  rv = connection_write_timed(&write->ssl, write->connection.fd, &write->connection);
+  if ( rv != 0 || connection_writes_wait(write, EPOLL_CTL_MOD) < 0 ) {
+    connection_writes_finish(write);
+    return;
+  }
+
+  if ( write->connection.offset != offset ) {
+    connection_writes_unlink(write);
+    write->deadline = connection_write_deadline(write->started, write->connection.offset);
+    connection_writes_link(write);
+  }
+}
+
+/*
+Hand the rest of response to the event loop. Shared file and statistics in
+arena are valid only until connection_run() returns, so the file is duplicated
+and the statistics copied. Returns -1 when worker has to write it itself.
+*/
+static int connection_writes_start(ts_socket_t *sock, struct ts_ssl *ssl, ps_connection_t *connection) {
+
+  ts_connection_write_t *write;
+  int filefd;
+
+  if ( connection_writes == NULL )
+    return -1;
+  write = connection_writes_free;
+  if ( write == NULL && connection_writes_used < TS_WRITES_MAX )
+    write = &connection_writes[connection_writes_used];
+  if ( write == NULL )
+    return -1;
+
+  filefd = connection->filefd;
+  if ( connection->filefd && connection->fileshared && (filefd = dup(connection->filefd)) < 0 )
+    return -1;
+  write->body = NULL;
+  if ( connection->str && connection->response_type == SEND_STATS ) {
+    write->body = malloc(connection->length);
+    if ( write->body == NULL ) {
+      if ( filefd != connection->filefd )
+        close(filefd);
+      return -1;
+    }
+    memcpy(write->body, connection->str, connection->length);
+  }
+
+  write->connection = *connection;
+  if ( write->body )
+    write->connection.str = write->body;
+  write->connection.filefd = filefd;
+  write->connection.fileshared = 0;
+  if ( connection_writes_wait(write, EPOLL_CTL_ADD) < 0 ) {
+    if ( filefd != connection->filefd )
+      close(filefd);
+    free(write->body);
+    write->body = NULL;
+    return -1;
+  }
+
+  /* Slot is taken, connection belongs to it from now on. */
+  if ( write == connection_writes_free )
+    connection_writes_free = write->next;
+  else
+    connection_writes_used++;
+  connection->filefd = 0;
+  connection->fileshared = 0;
+
+  write->sock = sock;
+  memcpy(&write->peer, connection->peer, sizeof(write->peer));
+  write->connection.peer = &write->peer;
+  write->status = connection->response->status_code;
+  if ( ts_log_enabled() )
+    connection_log_prepare(connection, &write->record);
+  write->connection.arena = NULL;
+  write->connection.request = NULL;
+  write->connection.response = NULL;
+  write->ssl = *ssl;
+  write->ssl.servername = NULL;
+  write->ssl.arena = NULL;
+#ifdef USE_SSL
+  if ( write->ssl.s )
+    SSL_set_app_data(write->ssl.s, &write->ssl);
+#endif
+  ssl->s = NULL;
+
+  write->started = ts_clock_ms();
+  write->deadline = connection_write_deadline(write->started, write->connection.offset);
+  connection_writes_link(write);
+
+  return 0;
+}
+
+/*
+Responses whose client did not read them in time are given up.
+Returns milliseconds until the next deadline, -1 when no write is pending.
+*/
+int connection_writes_expire(void) {
+
+  long long now;
+
+  if ( connection_writes_head == NULL )
+    return -1;
+
+  now = ts_clock_ms();
+  while ( connection_writes_head && connection_writes_head->deadline <= now ) {
+    DEBUG_PRINT("Write timeout on socket %d after %ld bytes.", connection_writes_head->connection.fd,
+                (long)connection_writes_head->connection.offset);
+    connection_writes_finish(connection_writes_head);
+  }
+
+  return connection_writes_head ? (int)(connection_writes_head->deadline - now) : -1;
+}
+
+/*
+Read what has arrived of request body without waiting for the rest, which is
+drained after the response by connection_close().
+*/
+static void connection_drain(struct ts_ssl *ssl, int fd, ps_connection_t *connection) {
+
+  char buffer[CHAR_BUF_SIZE];
+  int rv;
+
+#ifndef USE_SSL
+  (void)ssl;
+#endif /* USE_SSL */
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  do {
+#ifdef USE_SSL
+    if ( connection->tls )
+      rv = SSL_read(ssl->s, buffer, sizeof(buffer));
     else
 #endif /* USE_SSL */
-      size += send(fd, connection->str, connection->length, MSG_NOSIGNAL);
-  }
+      rv = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+  } while ( rv > 0 );
 
-  return size;
+  connection->linger = 1;
 }
 
-int connection_new(ts_socket_t *sock, int fd) {
+/*
+Serve connection from its request to close. Request is read here unless caller
+read it, length is then what the read returned, or -1 when it failed.
+*/
+static int connection_run(ts_socket_t *sock, int fd, const struct sockaddr_storage *peer, long long accepted,
+                          struct ts_ssl *ssl, int tls, char *request, int length) {
 
-  int yes;
-  int http_error;
-  unsigned int index;
-  struct timeval timeout;
+  static __thread ts_arena_t arena;
+  static __thread int arena_prepared = 0;
+
+  int http_error, deferred;
+  socklen_t addrlen;
+  ts_log_record_t record;
   ps_http_request_header_t request_header;
   ps_http_response_header_t response_header;
-  char request_buffer[CHAR_BUF_SIZE];
+  char buffer[CHAR_BUF_SIZE];
+  char *request_buffer;
   int request_buffer_size;
-  struct ts_ssl ssl;
   ps_connection_t connection;
 
-  /*
-  The socket is connected, but we need to perform a check for incoming data.
-  Since we're using blocking checks, we first want to set a timeout.
-  */
-  timeout.tv_sec = 1;
-  timeout.tv_usec = 0;
-  if ( setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(struct timeval)) < 0 ) {
-    return -1;
+  /* Arena is kept for the whole life of worker and reused for every connection. */
+  if ( !arena_prepared ) {
+    if ( ts_arena_init(&arena) < 0 )
+      return -1;
+    arena_prepared = 1;
   }
 
-  yes = 1;
-  setsockopt(fd, IPPROTO_TCP, TCP_CORK, (void *)&yes, sizeof(yes));
+  /* Cached files and certificates stay valid until the connection is done. */
+  ts_epoch_enter();
 
   /* Create new connection. */
   connection.str = NULL;
   connection.length = -1;
   connection.filefd = 0;
+  connection.fileshared = 0;
+  connection.fd = fd;
+  connection.tls = tls;
+  connection.buffer_length = 0;
+  connection.offset = 0;
+  connection.corked = 0;
+  connection.events = 0;
+  connection.linger = 0;
+  connection.response_type = SEND_ERROR;
+  deferred = 0;
+  connection.accepted = accepted;
+  connection.peer = peer;
+  /* Socket is closed before it is logged, prefix listeners serve many addresses. */
+  addrlen = sizeof(connection.local);
+  connection.local.ss_family = AF_UNSPEC;
+  if ( ts_log_enabled() && getsockname(fd, (struct sockaddr *)&connection.local, &addrlen) < 0 )
+    connection.local.ss_family = AF_UNSPEC;
+  connection.arena = &arena;
   connection.request = &request_header;
   connection.response = &response_header;
-
-  DEBUG_PRINT("Reading from socket %d.", fd);
-
-  request_buffer_size = connection_read(sock, &ssl, fd, request_buffer, sizeof(request_buffer) - 1);
-  if ( request_buffer_size < 0 && errno != 0 ) {
-     DEBUG_PRINT("Received errno: %d", errno);
+  request_header.filename = NULL;
+  request_header.header_start = NULL;
+  request_header.arena = &arena;
+  response_header.status_code = 0;
+  response_header.arena = &arena;
+  ssl->arena = &arena;
+
+  if ( request == NULL && length == 0 ) {
+    DEBUG_PRINT("Reading from socket %d.", fd);
+    request_buffer = buffer;
+    request_buffer_size = connection_read(sock, ssl, &connection, request_buffer, sizeof(buffer) - 1);
+    if ( request_buffer_size < 0 && errno != 0 ) {
+       DEBUG_PRINT("Received errno: %d", errno);
+    }
+  }
+  else {
+    request_buffer = request;
+    request_buffer_size = length;
   }
 
   if ( request_buffer_size > 0 ) {
@@ -404,60 +1132,103 @@ int connection_new(ts_socket_t *sock, int fd) {
 
     if ( request_buffer[0] == 0x16 ) {
       send(fd, content_noSSL, sizeof(content_noSSL) - 1, MSG_NOSIGNAL);
+      TS_STATS_INC(responses[SEND_NOSSL]);
     }
     else {
       request_buffer[request_buffer_size] = 0;
 
       http_error = 0;
-      request_header.filename = NULL;
+      TRACE_BEGIN(trace_parse);
       http_header_parse(&request_header, request_buffer, &http_error);
+      TRACE_END(TRACE_PARSE, trace_parse);
 
-      if ( request_header.method == HTTP_METHOD_POST ) {
-        /* Socket may still be opened for reading, so read any data that is still waiting for us. */
-        do {
-#ifdef USE_SSL
-          if ( sock->options & DO_SSL )
-            request_buffer_size = SSL_read(ssl.s, request_buffer, sizeof(request_buffer) - 1);
-          else
-#endif /* USE_SSL */
-            request_buffer_size = recv(fd, request_buffer, sizeof(request_buffer) - 1, 0);
-        } while ( request_buffer_size > 0 );
-      }
+      /* Socket may still be opened for reading, so read any data that is still waiting for us. */
+      if ( request_header.method == HTTP_METHOD_POST )
+        connection_drain(ssl, fd, &connection);
 
       response_header.version = HTTP_VERSION_10;
       memset(&response_header.field, 0, sizeof(response_header.field));
       http_header_setvalue(&response_header, HEADER_CONNECTION, "close");
 
-      if ( http_error == 0 )
+      if ( http_error == 0 ) {
+        TRACE_BEGIN(trace_serve);
         serve(&connection, sock, &http_error);
+        TRACE_END(TRACE_SERVE, trace_serve);
+      }
 
-      /* Free request header structures. */
-      if ( request_header.filename )
-        free(request_header.filename);
-
-      if ( http_error != 0 )
+      if ( http_error != 0 ) {
         response_header.status_code = http_error;
+        connection.response_type = SEND_ERROR;
+        connection.length = 0;
+        connection.str = NULL;
+        connection_file_close(&connection);
+      }
 
-      connection_write(sock, &ssl, fd, &connection);
-
-      /* Free response header structures. */
-      for ( index = 0; index < HTTP_HEADER_FIELDS; index++ )
-        if ( response_header.field[index] )
-          free(response_header.field[index]);
+      TS_STATS_INC(responses[connection.response_type]);
+      ts_stats_status(response_header.status_code);
+
+      /* Rest of response the socket does not take at once is written by event loop as client reads it. */
+      TRACE_BEGIN(trace_write);
+      if ( connection_prepare(fd, &connection) < 0 )
+        connection_file_close(&connection);
+      else if ( connection_send(ssl, fd, &connection) == 0 ) {
+        deferred = connection_writes_start(sock, ssl, &connection) == 0;
+        if ( !deferred )
+          connection_flush(ssl, fd, &connection);
+      }
+      TRACE_END(TRACE_WRITE, trace_write);
 
     }
   }
 
-#ifdef USE_SSL
-  if ( sock->options & DO_SSL ) {
-    DEBUG_PRINT("Closing down ssl");
-    ts_ssl_session_close(&ssl);
+  if ( !deferred ) {
+    if ( ts_log_enabled() )
+      connection_log_prepare(&connection, &record);
+    connection_done(sock, fd, &connection, ssl, response_header.status_code, ts_log_enabled() ? &record : NULL);
   }
-#endif
 
-  /* Close the connection. */
-  shutdown(fd, SHUT_RDWR);
-  close(fd);
+  /* Release all request scoped memory at once. */
+  ts_arena_reset(connection.arena);
+
+  ts_epoch_leave();
 
   return 0;
 }
+
+int connection_new(ts_socket_t *sock, int fd, const struct sockaddr_storage *peer) {
+
+  struct ts_ssl ssl;
+  int tls;
+
+  /*
+  The socket is connected, but we need to perform a check for incoming data.
+  Since we're using blocking checks, we first want to set a timeout.
+  */
+  if ( connection_timeout(fd) < 0 ) {
+    return -1;
+  }
+
+  TS_STATS_INC(connections_accepted);
+  TS_STATS_INC(connections_active);
+  TS_PROBE1(connection_start, fd);
+
+  tls = ( sock->options & DO_DETECT ) ? connection_detect(fd) : ( sock->options & DO_SSL ) != 0;
+  ssl.s = NULL;
+  return connection_run(sock, fd, peer, ts_clock_ns(), &ssl, tls, NULL, 0);
+}
+
+#ifdef USE_SSL
+/*
+Serve connection whose handshake and request were read by event loop of worker,
+ssl->s is NULL when the first byte showed plain HTTP. Accepted time is kept,
+the rest of connection is served as any other.
+*/
+int connection_resume(ts_socket_t *sock, int fd, const struct sockaddr_storage *peer, long long accepted,
+                      struct ts_ssl *ssl, char *request, int length) {
+
+  if ( fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0 || connection_timeout(fd) < 0 )
+    length = -1;
+
+  return connection_run(sock, fd, peer, accepted, ssl, ssl->s != NULL, request, length);
+}
+#endif /* USE_SSL */
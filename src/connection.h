@@ -2,19 +2,76 @@
 #define _TINYSRV_CONNECTION_H
 
 #include "project.h"
+#include "accesslog.h"
 #include "config.h"
 #include "http.h"
+#include "ssl.h"
+
+#include <sys/socket.h> /* struct sockaddr_storage */
+#include <sys/types.h> /* off_t */
+
+/* Responses of every worker written by its event loop, further ones block the worker. */
+#define TS_WRITES_MAX 1024
 
 struct ts_connection {
+  int fd;
+  /* Connection speaks TLS, set by listener or by its first byte. */
+  int tls;
   const char *str;
   int length;
   int filefd;
+  /* File descriptor belongs to the file cache and is not closed. */
+  int fileshared;
+  /* Response header, optionally followed by small body. */
+  char buffer[CHAR_BUF_SIZE];
+  int buffer_length;
+  /* Bytes of response already written, header included. */
+  off_t offset;
+  int corked;
+  /* poll() events the pending write waits for. */
+  short events;
+  /* Request body may still arrive, it is read until client closes. */
+  int linger;
+  response_enum response_type;
+  /* Monotonic time of accept in nanoseconds. */
+  long long accepted;
+  const struct sockaddr_storage *peer;
+  /* Address the client connected to, taken only for the access log. */
+  struct sockaddr_storage local;
+  /* Request scoped memory. */
+  ts_arena_t *arena;
   ps_http_request_header_t *request;
   ps_http_response_header_t *response;
 };
 
 typedef struct ts_connection ps_connection_t;
 
+/*
+Connection whose response did not fit into its socket at once, written by the
+event loop of worker as client reads it. Request scoped memory is reused by
+then, so everything needed to finish the connection is kept here.
+*/
+struct ts_connection_write {
+  ts_socket_t *sock;
+  ps_connection_t connection;
+  struct ts_ssl ssl;
+  struct sockaddr_storage peer;
+  /* Statistics body copied out of the arena. */
+  char *body;
+  int status;
+  /* Access log record, completed once connection is closed. */
+  ts_log_record_t record;
+  /* Events the socket is registered for. */
+  unsigned int events;
+  /* Monotonic time write was taken over, and deadline, in milliseconds. */
+  long long started;
+  long long deadline;
+  struct ts_connection_write *prev;
+  struct ts_connection_write *next;
+};
+
+typedef struct ts_connection_write ts_connection_write_t;
+
 static const char content_noSSL[] =
   "\x15" /* Alert (21) */
   "\x03\x00" /* Version 3.0 */
@@ -23,6 +80,18 @@ static const char content_noSSL[] =
   "\x00" /* 0 close notify, 0x28 Handshake failure 40, 0x31 TLS access denied 49 */
   "\x00"; /* string terminator (not part of actual response) */
 
+static const char content_shed[] =
+  "HTTP/1.1 503 Service Unavailable\r\n"
+  "Content-Length: 0\r\n"
+  "Retry-After: 1\r\n"
+  "Connection: close\r\n\r\n";
+
+static const char content_limited[] =
+  "HTTP/1.1 429 Too Many Requests\r\n"
+  "Content-Length: 0\r\n"
+  "Retry-After: 1\r\n"
+  "Connection: close\r\n\r\n";
+
 static const char content_jsclose[] =
   "<!DOCTYPE html><html><head><meta charset='utf-8'/>"
   "<title></title><script type='text/javascript'>"
@@ -30,6 +99,15 @@ static const char content_jsclose[] =
   "if(self==top){a.close();if(c&&c.length>0){var d=D(c),e=d.split(z).reverse();if(e.length>1){var f='u='+e.slice(0,2).reverse().join(z);b.cookie!=f&&(b.cookie=f,a.history.back())}}}"
   "</script></head></html>";
 
-int connection_new(ts_socket_t *, int);
+int connection_new(ts_socket_t *, int, const struct sockaddr_storage *);
+#ifdef USE_SSL
+int connection_resume(ts_socket_t *, int, const struct sockaddr_storage *, long long, struct ts_ssl *, char *, int);
+#endif
+void connection_shed(ts_socket_t *, int, int);
+void connection_files_clear(void);
+int connection_writes_init(int);
+int connection_writes_owns(const void *);
+void connection_writes_event(void *);
+int connection_writes_expire(void);
 
 #endif
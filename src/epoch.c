@@ -0,0 +1,124 @@
+#include "epoch.h"
+
+#include <stdlib.h> /* free(), malloc() */
+#include <syslog.h>
+
+/* Object waiting until no thread can see it. */
+struct ts_epoch_retired {
+  struct ts_epoch_retired *next;
+  unsigned long epoch;
+  void *ptr;
+  void (*release)(void *);
+};
+
+static ts_epoch_slot_t ts_epoch_slots[TS_MAX_WORKERS];
+static unsigned int ts_epoch_slot_count = 0;
+static unsigned long ts_epoch_global = 0;
+
+/* Slot and retired objects of this thread. */
+static __thread ts_epoch_slot_t *ts_epoch_self = NULL;
+static __thread struct ts_epoch_retired *ts_epoch_limbo = NULL;
+
+/* Give calling thread a slot, done once by every worker. */
+int ts_epoch_register(void) {
+
+  unsigned int index;
+
+  if ( ts_epoch_self )
+    return 0;
+
+  index = __atomic_fetch_add(&ts_epoch_slot_count, 1, __ATOMIC_RELAXED);
+  if ( index >= TS_MAX_WORKERS ) {
+    syslog(LOG_WARNING, "No epoch slot left for worker.");
+    return -1;
+  }
+
+  ts_epoch_self = &ts_epoch_slots[index];
+  return 0;
+}
+
+void ts_epoch_enter(void) {
+
+  if ( ts_epoch_self == NULL )
+    return;
+
+  __atomic_store_n(&ts_epoch_self->epoch, __atomic_load_n(&ts_epoch_global, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+  __atomic_store_n(&ts_epoch_self->active, 1, __ATOMIC_RELAXED);
+  /* Announcement must be visible before any shared pointer is read. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Global epoch moves on only when every active thread has seen the current one. */
+static unsigned long ts_epoch_advance(void) {
+
+  unsigned long epoch;
+  unsigned int index, count;
+
+  epoch = __atomic_load_n(&ts_epoch_global, __ATOMIC_ACQUIRE);
+  count = __atomic_load_n(&ts_epoch_slot_count, __ATOMIC_RELAXED);
+  if ( count > TS_MAX_WORKERS )
+    count = TS_MAX_WORKERS;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for ( index = 0; index < count; index++ )
+    if ( __atomic_load_n(&ts_epoch_slots[index].active, __ATOMIC_RELAXED) &&
+         __atomic_load_n(&ts_epoch_slots[index].epoch, __ATOMIC_RELAXED) != epoch )
+      return epoch;
+
+  if ( __atomic_compare_exchange_n(&ts_epoch_global, &epoch, epoch + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) )
+    epoch++;
+  return epoch;
+}
+
+/* Release objects retired two epochs ago, no thread can hold them any more. */
+static void ts_epoch_reclaim(void) {
+
+  struct ts_epoch_retired **link, *retired;
+  unsigned long epoch;
+
+  epoch = ts_epoch_advance();
+  link = &ts_epoch_limbo;
+  while ( (retired = *link) != NULL ) {
+    if ( retired->epoch + 2 <= epoch ) {
+      *link = retired->next;
+      retired->release(retired->ptr);
+      free(retired);
+    }
+    else
+      link = &retired->next;
+  }
+}
+
+void ts_epoch_leave(void) {
+
+  if ( ts_epoch_self == NULL )
+    return;
+
+  __atomic_store_n(&ts_epoch_self->active, 0, __ATOMIC_RELEASE);
+  if ( ts_epoch_limbo )
+    ts_epoch_reclaim();
+}
+
+/* Release object when no reader can see it. Threads other than workers never share objects. */
+void ts_epoch_retire(void *ptr, void (*release)(void *)) {
+
+  struct ts_epoch_retired *retired;
+
+  if ( ts_epoch_self == NULL ) {
+    release(ptr);
+    return;
+  }
+
+  retired = malloc(sizeof(struct ts_epoch_retired));
+  if ( retired == NULL ) {
+    /* Leaking is safe, releasing is not. */
+    syslog(LOG_WARNING, "Cannot retire shared object: %m.");
+    return;
+  }
+
+  retired->epoch = __atomic_load_n(&ts_epoch_global, __ATOMIC_ACQUIRE);
+  retired->ptr = ptr;
+  retired->release = release;
+  retired->next = ts_epoch_limbo;
+  ts_epoch_limbo = retired;
+}
@@ -0,0 +1,24 @@
+#ifndef _TINYSRV_EPOCH_H
+#define _TINYSRV_EPOCH_H
+
+#include "project.h"
+
+/*
+Epoch based reclamation of read-mostly structures shared by worker threads.
+Readers enter an epoch around every use of shared objects and never lock.
+Writers unlink an object and retire it, it is released once every thread
+which might still see it has left its epoch.
+*/
+struct ts_epoch_slot {
+  unsigned long epoch;
+  int active;
+} __attribute__((aligned(TS_CACHE_LINE)));
+
+typedef struct ts_epoch_slot ts_epoch_slot_t;
+
+int ts_epoch_register(void);
+void ts_epoch_enter(void);
+void ts_epoch_leave(void);
+void ts_epoch_retire(void *, void (*)(void *));
+
+#endif
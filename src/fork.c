@@ -1,11 +1,15 @@
 #include "fork.h"
 #include "project.h"
 #include "debug.h"
+#include "probes.h"
+#include "utils.h"
 
 #include <errno.h>
+#include <poll.h> /* ppoll() */
 #include <stddef.h>
 #include <stdlib.h> /* EXIT_FAILURE */
 #include <sys/wait.h> /* waitpid() */
+#include <time.h> /* struct timespec */
 #include <syslog.h> /* openlog(), syslog() */
 #include <unistd.h> /* fork() */
 
@@ -32,24 +36,82 @@ int subprocess_quit(void) {
   return 0;
 }
 
-int subprocess_add(int (*fn)(void *), void *arg) {
+struct fork_process_s *subprocess_add(int (*fn)(void *), void *arg) {
 
   struct fork_process_s *new_process;
 
   new_process = malloc(sizeof(struct fork_process_s));
   if ( new_process == NULL )
-    return -1;
+    return NULL;
 
   new_process->pid = 0;
   new_process->fn = fn;
   new_process->arg = arg;
+  new_process->started = 0;
+  new_process->next_start = 0;
+  new_process->backoff = 0;
+  new_process->retired = 0;
 
   new_process->next = process_list;
   process_list = new_process;
 
+  return new_process;
+}
+
+/* Forward signal to all running processes. */
+int subprocess_signal(int signum) {
+
+  struct fork_process_s *cur_process;
+
+  for ( cur_process = process_list; cur_process; cur_process = cur_process->next )
+    if ( cur_process->pid > 0 )
+      kill(cur_process->pid, signum);
   return 0;
 }
 
+/* Stop process for good, it is asked to finish its work and is not restarted. */
+int subprocess_retire(struct fork_process_s *process) {
+
+  process->retired = 1;
+  if ( process->pid > 0 )
+    return kill(process->pid, SIGTERM);
+  return 0;
+}
+
+/* Retired processes which did not exit yet. */
+int subprocess_retiring(void) {
+
+  struct fork_process_s *cur_process;
+  int count;
+
+  count = 0;
+  for ( cur_process = process_list; cur_process; cur_process = cur_process->next )
+    if ( cur_process->retired && cur_process->pid > 0 )
+      count++;
+  return count;
+}
+
+static void subprocess_remove_retired(void) {
+
+  struct fork_process_s **link, *cur_process;
+
+  link = &process_list;
+  while ( (cur_process = *link) != NULL ) {
+    if ( cur_process->retired && cur_process->pid == 0 ) {
+      *link = cur_process->next;
+      free(cur_process);
+    }
+    else
+      link = &cur_process->next;
+  }
+}
+
+static void subprocess_child_handler(int signum) {
+
+  /* Only interrupts waiting of supervisor. */
+  (void)signum;
+}
+
 static void subprocess_signal_handler(int signum) {
 
   if ( signum == SIGTERM ) {
@@ -75,23 +137,79 @@ static int subprocess_setup_signal_handler(void) {
   return 0;
 }
 
-int subprocess_run(void) {
+/* Exited process is restarted with delay growing while it keeps crashing. */
+static void subprocess_exited(struct fork_process_s *process, long long now) {
+
+  process->pid = 0;
+  if ( process->retired )
+    return;
+
+  if ( now - process->started < SUBPROCESS_STABLE ) {
+    process->backoff = process->backoff ? process->backoff * 2 : SUBPROCESS_BACKOFF_MIN;
+    if ( process->backoff > SUBPROCESS_BACKOFF_MAX )
+      process->backoff = SUBPROCESS_BACKOFF_MAX;
+    syslog(LOG_WARNING, "Subprocess exited %lld ms after start, restarting in %lld ms.", now - process->started, process->backoff);
+  }
+  else
+    process->backoff = 0;
+
+  process->next_start = now + process->backoff;
+  DEBUG_PRINT("Subprocess scheduled for restart.");
+}
+
+/*
+Start subprocesses, restart them when they exit and call tick every interval
+milliseconds until terminated, and also right after a signal was handled.
+Signals are blocked except while waiting, so that no child exit or request
+is missed.
+*/
+int subprocess_run(int (*tick)(void *), void *arg, int interval) {
 
   struct fork_process_s *cur_process;
-  int new_pid, status;
+  struct sigaction sa;
+  struct timespec ts;
+  sigset_t mask, oldmask;
+  long long now, next_tick, wake;
+  int new_pid, status, known;
   pid_t pid;
 
-  for (;;) {
+  sa.sa_flags = 0;
+  sa.sa_handler = subprocess_child_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGCHLD, &sa, NULL);
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+  next_tick = ts_clock_ms() + interval;
+
+  while ( !terminated ) {
+
+    now = ts_clock_ms();
+    wake = next_tick;
 
     for ( cur_process = process_list; cur_process; cur_process = cur_process->next ) {
 
-      if ( cur_process->pid != 0 )
+      if ( cur_process->pid != 0 || cur_process->retired )
         continue;
 
+      if ( cur_process->next_start > now ) {
+        if ( cur_process->next_start < wake )
+          wake = cur_process->next_start;
+        continue;
+      }
+
       /* Start subprocess. */
       new_pid = fork();
       if ( new_pid == 0 ) {
 
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        signal(SIGCHLD, SIG_DFL);
         signal(SIGINT, SIG_IGN);
         if ( subprocess_setup_signal_handler() < 0 ) {
           exit(EXIT_FAILURE);
@@ -104,7 +222,13 @@ int subprocess_run(void) {
       }
       else if ( new_pid > 0 ) {
         cur_process->pid = new_pid;
+        cur_process->started = now;
         syslog(LOG_INFO, "Created new subprocess with PID %ld.", (long)new_pid);
+        TS_PROBE1(subprocess_start, new_pid);
+      }
+      else {
+        syslog(LOG_WARNING, "Cannot fork subprocess: %m.");
+        cur_process->next_start = now + SUBPROCESS_BACKOFF_MIN;
       }
 
     }
@@ -113,32 +237,61 @@ int subprocess_run(void) {
 #ifndef WAIT_ANY
  #define WAIT_ANY -1
 #endif
-    pid = waitpid(WAIT_ANY, &status, 0);
+    while ( (pid = waitpid(WAIT_ANY, &status, WNOHANG)) > 0 ) {
 
-    syslog(LOG_INFO, "Subprocess with PID %ld exited with status 0x%04x.", (long)pid, status);
+      syslog(LOG_INFO, "Subprocess with PID %ld exited with status 0x%04x.", (long)pid, status);
+      TS_PROBE2(subprocess_exit, pid, status);
+
+      known = 0;
+      for ( cur_process = process_list; cur_process; cur_process = cur_process->next )
+        if ( cur_process->pid == pid )
+          known = 1;
+      /* Other children, like a server started by upgrade, do not stop us. */
+      if ( !known )
+        continue;
 
-    if ( pid == -1 || ( WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE ) ) {
+      if ( WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE ) {
         terminated = 1;
-    }
-    else {
+        break;
+      }
+
+      now = ts_clock_ms();
       for ( cur_process = process_list; cur_process; cur_process = cur_process->next )
-        if ( cur_process->pid == pid ) {
-          cur_process->pid = 0;
-          DEBUG_PRINT("Subprocess scheduled for restart.");
-        }
+        if ( cur_process->pid == pid )
+          subprocess_exited(cur_process, now);
+      /* Restarts are scheduled, start them on the next round. */
+      wake = now;
     }
+    subprocess_remove_retired();
 
-    if ( terminated ) {
-      DEBUG_PRINT("Kill all running subprocesses.");
-      for ( cur_process = process_list; cur_process; cur_process = cur_process->next )
-        if ( cur_process->pid > 0 ) {
-          kill(cur_process->pid, SIGTERM);
-          cur_process->pid = 0;
-        }
+    if ( terminated )
       break;
+
+    now = ts_clock_ms();
+    if ( now >= next_tick ) {
+      if ( tick )
+        tick(arg);
+      next_tick = now + interval;
+      continue;
+    }
+
+    if ( wake > now ) {
+      ts.tv_sec = (wake - now) / 1000;
+      ts.tv_nsec = (wake - now) % 1000 * 1000000;
+      if ( ppoll(NULL, 0, &ts, &oldmask) < 0 && errno == EINTR && tick && !terminated )
+        tick(arg);
     }
 
   }
 
+  DEBUG_PRINT("Kill all running subprocesses.");
+  for ( cur_process = process_list; cur_process; cur_process = cur_process->next )
+    if ( cur_process->pid > 0 ) {
+      kill(cur_process->pid, SIGTERM);
+      cur_process->pid = 0;
+    }
+
+  sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
   return 0;
 }
@@ -3,16 +3,31 @@
 
 extern volatile int terminated;
 
+/* Restart delay of a process which keeps exiting soon after its start. */
+#define SUBPROCESS_BACKOFF_MIN 100
+#define SUBPROCESS_BACKOFF_MAX 30000
+/* Process running this many milliseconds is not crash looping. */
+#define SUBPROCESS_STABLE 10000
+
 struct fork_process_s {
   int pid;
   int (*fn)(void *);
   void *arg;
+  /* Monotonic time of the last start and earliest time of the next one, in milliseconds. */
+  long long started;
+  long long next_start;
+  long long backoff;
+  /* Process is stopped for good, it is freed once it exits. */
+  int retired;
   struct fork_process_s *next;
 };
 
 int subprocess_init(void);
 int subprocess_quit(void);
-int subprocess_add(int (*)(void *), void *);
-int subprocess_run(void);
+struct fork_process_s *subprocess_add(int (*)(void *), void *);
+int subprocess_signal(int);
+int subprocess_retire(struct fork_process_s *);
+int subprocess_retiring(void);
+int subprocess_run(int (*)(void *), void *, int);
 
 #endif
@@ -0,0 +1,260 @@
+#ifdef USE_SSL
+
+#include "handshake.h"
+#include "connection.h"
+#include "epoch.h"
+#include "probes.h"
+#include "stats.h"
+#include "trace.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h> /* F_SETFL, F_GETFL, fcntl() */
+#include <poll.h> /* POLLOUT */
+#include <stdlib.h> /* calloc(), free() */
+#include <string.h> /* memcpy() */
+#include <sys/epoll.h> /* epoll_ctl() */
+#include <syslog.h>
+
+/*
+Slots of worker. Free ones are linked through next, pending ones from head to
+tail in order of accept. A worker may keep thousands of slow handshakes, it is
+busy only while their data are processed.
+*/
+static __thread ts_handshake_t *ts_handshake_slots = NULL;
+static __thread ts_handshake_t *ts_handshake_free;
+static __thread ts_handshake_t *ts_handshake_head;
+static __thread ts_handshake_t *ts_handshake_tail;
+static __thread unsigned int ts_handshake_count;
+/* Pending handshakes of every listener, by its index. */
+static __thread unsigned int *ts_handshake_listener_count;
+static __thread int ts_handshake_epfd;
+/* Servername callback copies names here, they are not needed once it returns. */
+static __thread ts_arena_t ts_handshake_arena;
+
+/* Allocate slots of worker whose sockets are registered with epfd, for given number of listeners. */
+int ts_handshake_init(int epfd, unsigned int listeners) {
+
+  unsigned int i;
+
+  ts_handshake_slots = calloc(TS_HANDSHAKE_MAX, sizeof(ts_handshake_t));
+  ts_handshake_listener_count = calloc(listeners, sizeof(unsigned int));
+  if ( ts_handshake_slots == NULL || ts_handshake_listener_count == NULL || ts_arena_init(&ts_handshake_arena) < 0 ) {
+    syslog(LOG_WARNING, "Cannot allocate TLS handshakes, they are done by blocking reads.");
+    free(ts_handshake_slots);
+    free(ts_handshake_listener_count);
+    ts_handshake_slots = NULL;
+    ts_handshake_listener_count = NULL;
+    return -1;
+  }
+
+  for ( i = 0; i + 1 < TS_HANDSHAKE_MAX; i++ )
+    ts_handshake_slots[i].next = &ts_handshake_slots[i + 1];
+  ts_handshake_free = ts_handshake_slots;
+  ts_handshake_head = NULL;
+  ts_handshake_tail = NULL;
+  ts_handshake_count = 0;
+  ts_handshake_epfd = epfd;
+
+  return 0;
+}
+
+/* Event data of epoll point either to listener, or to slot of handshake. */
+int ts_handshake_owns(const void *ptr) {
+
+  return ts_handshake_slots != NULL &&
+    (const ts_handshake_t *)ptr >= ts_handshake_slots &&
+    (const ts_handshake_t *)ptr < ts_handshake_slots + TS_HANDSHAKE_MAX;
+}
+
+/* Connection leaves the event loop and is served, then its slot is free again. */
+static void ts_handshake_finish(ts_handshake_t *handshake, char *request, int length) {
+
+  epoll_ctl(ts_handshake_epfd, EPOLL_CTL_DEL, handshake->fd, NULL);
+
+  if ( handshake->prev )
+    handshake->prev->next = handshake->next;
+  else
+    ts_handshake_head = handshake->next;
+  if ( handshake->next )
+    handshake->next->prev = handshake->prev;
+  else
+    ts_handshake_tail = handshake->prev;
+  ts_handshake_count--;
+  ts_handshake_listener_count[handshake->sock->index]--;
+  TS_STATS_STORE(ts_stats->tls_handshakes_pending, ts_handshake_count);
+
+  connection_resume(handshake->sock, handshake->fd, &handshake->peer, handshake->accepted,
+                    &handshake->ssl, request, length);
+
+  handshake->next = ts_handshake_free;
+  ts_handshake_free = handshake;
+}
+
+/* Socket is watched for what TLS library waits for. */
+static void ts_handshake_wait(ts_handshake_t *handshake, int want) {
+
+  struct epoll_event event;
+
+  event.events = ( want == POLLOUT ) ? EPOLLOUT : EPOLLIN;
+  if ( event.events == handshake->events )
+    return;
+  event.data.ptr = handshake;
+  if ( epoll_ctl(ts_handshake_epfd, EPOLL_CTL_MOD, handshake->fd, &event) < 0 ) {
+    ts_handshake_finish(handshake, NULL, -1);
+    return;
+  }
+  handshake->events = event.events;
+}
+
+/* Advance handshake as far as the socket allows, serve connection once its request is read. */
+void ts_handshake_event(void *ptr) {
+
+  ts_handshake_t *handshake;
+  char request[CHAR_BUF_SIZE];
+  unsigned char first;
+  int rv, want;
+
+  handshake = (ts_handshake_t *)ptr;
+
+  if ( handshake->detecting ) {
+    rv = recv(handshake->fd, &first, 1, MSG_PEEK);
+    if ( rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+      return;
+    handshake->detecting = 0;
+    if ( rv != 1 || first != 0x16 ) {
+      /* Plain HTTP, its first data are there already. */
+      rv = recv(handshake->fd, request, sizeof(request) - 1, 0);
+      ts_handshake_finish(handshake, request, rv);
+      return;
+    }
+  }
+
+  if ( handshake->ssl.s == NULL && ts_ssl_session_new(&handshake->ssl, handshake->fd) < 0 ) {
+    TS_STATS_INC(tls_handshake_failures);
+    ts_handshake_finish(handshake, NULL, -1);
+    return;
+  }
+
+  if ( !SSL_is_init_finished(handshake->ssl.s) ) {
+    /* Servername callback looks up cached certificates, which stay valid only inside an epoch. */
+    ts_epoch_enter();
+    rv = SSL_accept(handshake->ssl.s);
+    ts_epoch_leave();
+    ts_arena_reset(&ts_handshake_arena);
+    if ( rv <= 0 ) {
+      want = ts_ssl_want(handshake->ssl.s, rv);
+      if ( want ) {
+        ts_handshake_wait(handshake, want);
+        return;
+      }
+      TS_STATS_INC(tls_handshake_failures);
+      ts_handshake_finish(handshake, NULL, -1);
+      return;
+    }
+    TS_STATS_INC(tls_handshakes);
+    TRACE_END(TRACE_TLS_HANDSHAKE, handshake->accepted);
+  }
+
+  TRACE_BEGIN(trace_read);
+  rv = SSL_read(handshake->ssl.s, request, sizeof(request) - 1);
+  TRACE_END(TRACE_READ, trace_read);
+  if ( rv <= 0 ) {
+    want = ts_ssl_want(handshake->ssl.s, rv);
+    if ( want ) {
+      ts_handshake_wait(handshake, want);
+      return;
+    }
+  }
+  ts_handshake_finish(handshake, request, rv);
+}
+
+/*
+Take TLS connection, or connection of listener with -d, into the event loop.
+Returns -1 when it should be served by blocking reads instead.
+*/
+int ts_handshake_start(ts_socket_t *sock, int fd, const struct sockaddr_storage *peer) {
+
+  ts_handshake_t *handshake;
+  struct epoll_event event;
+
+  if ( ts_handshake_slots == NULL )
+    return -1;
+
+  handshake = ts_handshake_free;
+  if ( handshake == NULL ) {
+    connection_shed(sock, fd, 503);
+    return 0;
+  }
+
+  event.events = EPOLLIN;
+  event.data.ptr = handshake;
+  if ( fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+       epoll_ctl(ts_handshake_epfd, EPOLL_CTL_ADD, fd, &event) < 0 ) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return -1;
+  }
+
+  ts_handshake_free = handshake->next;
+  handshake->sock = sock;
+  handshake->fd = fd;
+  handshake->detecting = ( sock->options & DO_DETECT ) != 0;
+  handshake->events = EPOLLIN;
+  handshake->accepted = ts_clock_ns();
+  handshake->deadline = ts_clock_ms() + TS_HANDSHAKE_TIMEOUT;
+  memcpy(&handshake->peer, peer, sizeof(handshake->peer));
+  handshake->ssl.s = NULL;
+  handshake->ssl.servername = NULL;
+  handshake->ssl.cert_path = sock->cert_path;
+  handshake->ssl.arena = &ts_handshake_arena;
+
+  handshake->next = NULL;
+  handshake->prev = ts_handshake_tail;
+  if ( ts_handshake_tail )
+    ts_handshake_tail->next = handshake;
+  else
+    ts_handshake_head = handshake;
+  ts_handshake_tail = handshake;
+  ts_handshake_count++;
+  ts_handshake_listener_count[sock->index]++;
+
+  TS_STATS_INC(connections_accepted);
+  TS_STATS_INC(connections_active);
+  TS_STATS_STORE(ts_stats->tls_handshakes_pending, ts_handshake_count);
+  TS_PROBE1(connection_start, fd);
+
+  /* ClientHello is often there already, always with TCP_DEFER_ACCEPT. */
+  ts_handshake_event(handshake);
+  return 0;
+}
+
+/*
+Connections which did not finish handshake and send request in time are closed.
+Returns milliseconds until the next deadline, -1 when no handshake is pending.
+*/
+int ts_handshake_expire(void) {
+
+  long long now;
+
+  if ( ts_handshake_head == NULL )
+    return -1;
+
+  now = ts_clock_ms();
+  while ( ts_handshake_head && ts_handshake_head->deadline <= now ) {
+    if ( ts_handshake_head->ssl.s && !SSL_is_init_finished(ts_handshake_head->ssl.s) )
+      TS_STATS_INC(tls_handshake_failures);
+    ts_handshake_finish(ts_handshake_head, NULL, -1);
+  }
+
+  return ts_handshake_head ? (int)(ts_handshake_head->deadline - now) : -1;
+}
+
+/* Handshakes in progress of listener, or of all listeners when it is NULL. */
+unsigned int ts_handshake_pending(const ts_socket_t *sock) {
+
+  if ( ts_handshake_slots == NULL )
+    return 0;
+  return ( sock ) ? ts_handshake_listener_count[sock->index] : ts_handshake_count;
+}
+
+#endif /* USE_SSL */
@@ -0,0 +1,52 @@
+#ifndef _TINYSRV_HANDSHAKE_H
+#define _TINYSRV_HANDSHAKE_H
+
+#include "project.h"
+#include "config.h"
+#include "ssl.h"
+
+#ifdef USE_SSL
+
+#include <sys/socket.h> /* struct sockaddr_storage */
+
+/*
+Handshakes in progress of every worker, further TLS connections are shed. They
+count against -M and -O caps as connections waiting in accept queue do.
+*/
+#define TS_HANDSHAKE_MAX 4096
+/* Milliseconds from accept until handshake is done and request has arrived. */
+#define TS_HANDSHAKE_TIMEOUT 5000
+
+/*
+TLS connection from accept to its request, advanced by readiness events in the
+event loop of worker. Pending handshakes are linked in order of accept, which
+is also the order of their deadlines.
+*/
+struct ts_handshake {
+  ts_socket_t *sock;
+  int fd;
+  /* Listener with -d, protocol is not known until the first byte arrives. */
+  int detecting;
+  /* Events the socket is registered for. */
+  unsigned int events;
+  /* Monotonic time of accept in nanoseconds, and deadline in milliseconds. */
+  long long accepted;
+  long long deadline;
+  struct sockaddr_storage peer;
+  struct ts_ssl ssl;
+  struct ts_handshake *prev;
+  struct ts_handshake *next;
+};
+
+typedef struct ts_handshake ts_handshake_t;
+
+int ts_handshake_init(int, unsigned int);
+int ts_handshake_start(ts_socket_t *, int, const struct sockaddr_storage *);
+int ts_handshake_owns(const void *);
+void ts_handshake_event(void *);
+int ts_handshake_expire(void);
+unsigned int ts_handshake_pending(const ts_socket_t *);
+
+#endif /* USE_SSL */
+
+#endif
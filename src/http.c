@@ -1,10 +1,10 @@
 #include "http.h"
 #include "utils.h"
 
+#include <pthread.h> /* pthread_once() */
 #include <stddef.h>
 #include <stdio.h>
-#include <stdlib.h> /* free(), malloc() */
-#include <string.h> /* strcmp(), strncmp(), strndup(), strtok() */
+#include <string.h> /* strcmp(), strncmp(), strtok() */
 
 static const char *http_method_getstr(int method) {
   switch ( method ) {
@@ -36,23 +36,26 @@ static const ps_http_status_t *http_header_get_status(int status_code) {
   return &err_http_status;
 }
 
-static unsigned int http_header_field_getindex(unsigned int key_index) {
+static unsigned int http_index_map[HTTP_HEADER_FIELDS];
+static pthread_once_t http_index_once = PTHREAD_ONCE_INIT;
 
-  static unsigned int index_map[HTTP_HEADER_FIELDS];
-  static int prepared = 0;
+static void http_index_map_prepare(void) {
 
   unsigned int index;
 
-  if ( !prepared ) {
-    index = 0;
-    while ( http_field_keys[index].key ) {
-      index_map[http_field_keys[index].key_index] = index;
-      index++;
-    }
-    prepared = 1;
+  index = 0;
+  while ( http_field_keys[index].key ) {
+    http_index_map[http_field_keys[index].key_index] = index;
+    index++;
   }
+}
 
-  return index_map[key_index];
+static unsigned int http_header_field_getindex(unsigned int key_index) {
+
+  /* Worker threads may race for the first request. */
+  pthread_once(&http_index_once, http_index_map_prepare);
+
+  return http_index_map[key_index];
 }
 
 static unsigned int http_header_parse_connection(const char *str, const unsigned int len) {
@@ -148,7 +151,9 @@ int http_header_parse(ps_http_request_header_t *header, char *buffer, int *error
   if ( *str != '/' )
     return -1;
   tok = tu_strtok(&str, &tok_length, " \t");
-  header->filename = strndup(tok, tok_length);
+  header->filename = ts_arena_strndup(header->arena, tok, tok_length);
+  if ( header->filename == NULL )
+    return -1;
   header->query = header->filename + tok_length;
 
   while ( *str == ' ' || *str == '\t' )
@@ -250,7 +255,7 @@ char *http_header_getvalue(ps_http_request_header_t *header, const unsigned int
       line_length--;
     }
 
-    return strndup(str, line_length);
+    return ts_arena_strndup(header->arena, str, line_length);
   }
 
   return NULL;
@@ -265,10 +270,9 @@ int http_header_setvalue(ps_http_response_header_t *header, const unsigned int k
 
   index = http_header_field_getindex(key_index);
   if ( index ) {
-    if ( header->field[index] )
-      free(header->field[index]);
-    header->field[index] = strdup(value);
-    return 0;
+    /* Previous value stays in arena until the request is done. */
+    header->field[index] = ts_arena_strdup(header->arena, value);
+    return ( header->field[index] ) ? 0 : -1;
   }
   return -1;
 }
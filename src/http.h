@@ -2,6 +2,7 @@
 #define _TINYSRV_HTTP_H
 
 #include "project.h"
+#include "arena.h"
 #include <stddef.h>
 
 #define HEADER_HOSTNAME_STR "Host"
@@ -75,6 +76,7 @@ struct ps_http_request_header {
   char *query;
   /* HTTP header fields. */
   char *header_start;
+  ts_arena_t *arena;
 };
 
 typedef struct ps_http_request_header ps_http_request_header_t;
@@ -84,6 +86,7 @@ struct ps_http_response_header {
   /* HTTP status code. */
   int status_code;
   char *field[HTTP_HEADER_FIELDS];
+  ts_arena_t *arena;
 };
 
 typedef struct ps_http_response_header ps_http_response_header_t;
@@ -103,10 +106,14 @@ static const ps_http_status_t http_statuses[] = {
   { 204, "No Content" },
   { 307, "Temporary Redirect" },
   { 400, "Bad Request" },
+  { 429, "Too Many Requests" },
   { 501, "Method Not Implemented" },
+  { 503, "Service Unavailable" },
   { 0, NULL }
 };
 
+#define HTTP_STATUSES (sizeof(http_statuses) / sizeof(ps_http_status_t))
+
 int http_header_parse(ps_http_request_header_t *, char *, int *);
 char *http_header_getvalue(ps_http_request_header_t *, const unsigned int);
 
@@ -0,0 +1,80 @@
+#ifndef _TINYSRV_PROBES_H
+#define _TINYSRV_PROBES_H
+
+/*
+Static tracepoints in the format of systemtap's sys/sdt.h. Every probe is a
+single nop and a record in the .note.stapsdt section, so they cost nothing
+until perf, bpftrace or systemtap attaches to them:
+
+  bpftrace -e 'usdt:./tinysrv:tinysrv:serve { printf("%s\n", str(arg2)); }'
+
+All arguments are passed as 8 byte signed integers, strings as pointers.
+Arguments which cost something to compute are passed only while a tracer is
+attached, which it tells by incrementing the semaphore of the probe.
+Define NO_PROBES to build without them.
+*/
+
+#if !defined(NO_PROBES) && defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#define _TS_PROBE(name, semaphore, args, ...) \
+  __asm__ __volatile__ ( \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte " semaphore "\n" \
+    ".asciz \"tinysrv\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n" \
+    :: __VA_ARGS__ )
+
+#define _TS_PROBE_ARG(a) "nor" ((long)(a))
+
+#define TS_PROBE1(name, a1) \
+  _TS_PROBE(name, "0", "-8@%0", _TS_PROBE_ARG(a1))
+#define TS_PROBE2(name, a1, a2) \
+  _TS_PROBE(name, "0", "-8@%0 -8@%1", _TS_PROBE_ARG(a1), _TS_PROBE_ARG(a2))
+#define TS_PROBE3(name, a1, a2, a3) \
+  _TS_PROBE(name, "0", "-8@%0 -8@%1 -8@%2", _TS_PROBE_ARG(a1), _TS_PROBE_ARG(a2), _TS_PROBE_ARG(a3))
+#define TS_PROBE4(name, a1, a2, a3, a4) \
+  _TS_PROBE(name, "0", "-8@%0 -8@%1 -8@%2 -8@%3", _TS_PROBE_ARG(a1), _TS_PROBE_ARG(a2), _TS_PROBE_ARG(a3), _TS_PROBE_ARG(a4))
+
+/* Semaphore is defined once at file scope of the probe. */
+#define TS_PROBE_SEMAPHORE(name) \
+  volatile unsigned short tinysrv_##name##_semaphore __attribute__((section(".probes"), visibility("hidden")))
+#define TS_PROBE_ENABLED(name) __builtin_expect(tinysrv_##name##_semaphore != 0, 0)
+#define TS_PROBE3_GUARDED(name, a1, a2, a3) \
+  do { \
+    if ( TS_PROBE_ENABLED(name) ) \
+      _TS_PROBE(name, "tinysrv_" #name "_semaphore", "-8@%0 -8@%1 -8@%2", _TS_PROBE_ARG(a1), _TS_PROBE_ARG(a2), _TS_PROBE_ARG(a3)); \
+  } while (0)
+
+#else
+
+#define TS_PROBE1(name, a1) do { (void)(a1); } while (0)
+#define TS_PROBE2(name, a1, a2) do { (void)(a1); (void)(a2); } while (0)
+#define TS_PROBE3(name, a1, a2, a3) do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+#define TS_PROBE4(name, a1, a2, a3, a4) do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } while (0)
+
+/* Arguments of guarded probes are not evaluated. */
+#define TS_PROBE_SEMAPHORE(name) extern int tinysrv_##name##_semaphore_unused
+#define TS_PROBE_ENABLED(name) 0
+#define TS_PROBE3_GUARDED(name, a1, a2, a3) do { } while (0)
+
+#endif
+
+#endif
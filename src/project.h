@@ -3,6 +3,7 @@
 
 /*
 #define DEBUG
+#define TRACE
 */
 #define FORK
 #define _GNU_SOURCE
@@ -14,13 +15,42 @@
 #define CHAR_BUF_SIZE 8192
 #define MAX_PATH_LENGTH 200
 
+/* Reserved URL of statistics on listeners with DO_STATS option. */
+#define TS_STATS_URL "/.tinysrv/stats"
+
+/* Milliseconds a client may stall receiving response, also limit of unacknowledged data of closed connection. */
+#define TS_WRITE_TIMEOUT 10000
+/* Bytes per millisecond a client must read on average past TS_WRITE_TIMEOUT, 16 KB/s. */
+#define TS_WRITE_MIN_RATE 16
+/* Default milliseconds to wait for client to close first. */
+#define TS_TEARDOWN_WAIT_DEFAULT 200
+
 #define TS_BACKLOG SOMAXCONN
+/* Events returned by one epoll_wait() on listening sockets. */
+#define TS_LISTEN_EVENTS 16
+/* Worker stops accepting for this many milliseconds when descriptors above this percent of the limit are in use. */
+#define TS_ACCEPT_PAUSE 100
+#define TS_FD_HIGH_PERCENT 90
+/* Milliseconds between heartbeats of idle worker. */
+#define TS_HEARTBEAT_INTERVAL 1000
+/* Default milliseconds without heartbeat before supervisor replaces worker. */
+#define TS_STALL_TIMEOUT 30000
+/* Supervisor checks workers this often, and resizes pool by average utilization of a window of checks. */
+#define TS_SUPERVISOR_TICK 1000
+#define TS_SCALE_WINDOW 5
+#define TS_SCALE_UP 0.75
+#define TS_SCALE_DOWN 0.25
+#define TS_MAX_WORKERS 256
 
-#ifndef SO_REUSEPORT
-#define TS_SOL_SOCKET SO_REUSEADDR
-#else
-#define TS_SOL_SOCKET SO_REUSEADDR | SO_REUSEPORT
-#endif
+/* Environment passing listening sockets, locked PID file and PID of old server to upgraded one. */
+#define TS_ENV_LISTEN_FDS "TINYSRV_LISTEN_FDS"
+#define TS_ENV_PID_FD "TINYSRV_PID_FD"
+#define TS_ENV_PARENT "TINYSRV_PARENT"
+
+/* Open files kept by every process, and milliseconds before a cached file is checked again. */
+#define TS_FILE_CACHE_SIZE 1024
+#define TS_FILE_CACHE_VALID 1000
+#define TS_CACHE_LINE 64
 
 typedef enum {
   SEND_CSS,
@@ -35,7 +65,14 @@ typedef enum {
   SEND_SWF,
   SEND_TXT,
   SEND_NO_EXT,
-  SEND_UNK_EXT
+  SEND_UNK_EXT,
+  SEND_204,
+  SEND_REDIRECT,
+  SEND_JSCLOSE,
+  SEND_STATS,
+  SEND_NOSSL,
+  SEND_ERROR,
+  SEND_RESPONSE_TYPES
 } response_enum;
 
 #endif
@@ -0,0 +1,124 @@
+#include "ratelimit.h"
+#include "utils.h"
+
+#include <netinet/in.h> /* struct sockaddr_in, struct sockaddr_in6 */
+#include <stdint.h> /* uint32_t, uint64_t, uintptr_t */
+#include <stdlib.h> /* calloc() */
+#include <string.h> /* memcpy() */
+#include <sys/random.h> /* getrandom() */
+#include <syslog.h>
+
+/*
+Count-min sketch of token buckets kept by every worker, memory does not grow
+with number of clients. A client is limited only when buckets of all its cells
+are empty. Other clients draining the same cells can get it limited sooner than
+its own rate would, the false positive of count-min sketch accepted for fixed
+memory.
+*/
+static __thread ts_ratelimit_cell_t *ts_ratelimit_cells;
+static __thread unsigned int ts_ratelimit_mask;
+static __thread unsigned int ts_ratelimit_rate;
+static __thread unsigned int ts_ratelimit_burst;
+/* Random seed, so that clients cannot choose addresses colliding with others. */
+static __thread uint64_t ts_ratelimit_seed;
+
+/*
+Allocate sketch of given size in bytes for rate per second and burst, both in
+thousandths of connection.
+*/
+int ts_ratelimit_init(unsigned int rate, unsigned int burst, unsigned int memory) {
+
+  unsigned int columns;
+
+  columns = 64;
+  while ( columns * 2 * TS_RATELIMIT_ROWS * sizeof(ts_ratelimit_cell_t) <= memory )
+    columns *= 2;
+
+  ts_ratelimit_cells = calloc(columns * TS_RATELIMIT_ROWS, sizeof(ts_ratelimit_cell_t));
+  if ( ts_ratelimit_cells == NULL ) {
+    syslog(LOG_WARNING, "Cannot allocate rate limit sketch, clients are not limited.");
+    return -1;
+  }
+
+  ts_ratelimit_mask = columns - 1;
+  ts_ratelimit_share(rate, burst);
+  if ( getrandom(&ts_ratelimit_seed, sizeof(ts_ratelimit_seed), GRND_NONBLOCK) != sizeof(ts_ratelimit_seed) )
+    ts_ratelimit_seed = ts_clock_ns() ^ (uintptr_t)&ts_ratelimit_seed;
+
+  return 0;
+}
+
+/*
+Change rate and burst of worker when the pool is resized. Tokens over the new
+burst are dropped at the next refill of their cell.
+*/
+void ts_ratelimit_share(unsigned int rate, unsigned int burst) {
+
+  ts_ratelimit_rate = rate;
+  ts_ratelimit_burst = ( burst > TS_RATELIMIT_SCALE ) ? burst : TS_RATELIMIT_SCALE;
+}
+
+/* Client is IPv4 address, or /64 prefix of IPv6 address which is usually given to one host. */
+static uint64_t ts_ratelimit_key(const struct sockaddr_storage *addr) {
+
+  const struct sockaddr_in6 *ipv6;
+  uint64_t key;
+  uint32_t ipv4;
+
+  if ( addr->ss_family == AF_INET )
+    return ((const struct sockaddr_in *)addr)->sin_addr.s_addr;
+
+  /* Mapped client gets the same key as over IPv4, whatever the byte order. */
+  ipv6 = (const struct sockaddr_in6 *)addr;
+  if ( IN6_IS_ADDR_V4MAPPED(&ipv6->sin6_addr) ) {
+    memcpy(&ipv4, ipv6->sin6_addr.s6_addr + 12, sizeof(ipv4));
+    return ipv4;
+  }
+  memcpy(&key, ipv6->sin6_addr.s6_addr, sizeof(key));
+  return key;
+}
+
+/* Finalizer of splitmix64, halves of result select cells of the two rows. */
+static uint64_t ts_ratelimit_hash(uint64_t key) {
+
+  key ^= ts_ratelimit_seed;
+  key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+  return key ^ (key >> 31);
+}
+
+/* Take a token for connection from address, returns 0 when client is over its rate. */
+int ts_ratelimit_allow(const struct sockaddr_storage *addr) {
+
+  ts_ratelimit_cell_t *cell[TS_RATELIMIT_ROWS];
+  unsigned long long tokens, gained;
+  unsigned int row, now, allow;
+  uint64_t hash;
+
+  if ( ts_ratelimit_cells == NULL )
+    return 1;
+
+  hash = ts_ratelimit_hash(ts_ratelimit_key(addr));
+  now = (unsigned int)ts_clock_ms();
+  allow = 0;
+
+  for ( row = 0; row < TS_RATELIMIT_ROWS; row++ ) {
+    cell[row] = &ts_ratelimit_cells[row * (ts_ratelimit_mask + 1) + ((hash >> (32 * row)) & ts_ratelimit_mask)];
+    gained = (unsigned long long)(now - cell[row]->stamp) * ts_ratelimit_rate / 1000;
+    tokens = cell[row]->tokens + gained;
+    /* Time is kept until it buys a token fraction, busy cells would never refill at low rates. */
+    if ( gained > 0 || tokens >= ts_ratelimit_burst )
+      cell[row]->stamp = now;
+    cell[row]->tokens = ( tokens < ts_ratelimit_burst ) ? tokens : ts_ratelimit_burst;
+    if ( cell[row]->tokens >= TS_RATELIMIT_SCALE )
+      allow = 1;
+  }
+
+  if ( !allow )
+    return 0;
+
+  for ( row = 0; row < TS_RATELIMIT_ROWS; row++ )
+    if ( cell[row]->tokens >= TS_RATELIMIT_SCALE )
+      cell[row]->tokens -= TS_RATELIMIT_SCALE;
+  return 1;
+}
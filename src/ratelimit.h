@@ -0,0 +1,28 @@
+#ifndef _TINYSRV_RATELIMIT_H
+#define _TINYSRV_RATELIMIT_H
+
+#include "project.h"
+
+#include <sys/socket.h> /* struct sockaddr_storage */
+
+/* Tokens are counted in thousandths of a connection. */
+#define TS_RATELIMIT_SCALE 1000
+/* Default bytes of sketch of every worker. */
+#define TS_RATELIMIT_MEMORY 65536
+/* Rows of the sketch, every client is counted in one cell of each row. */
+#define TS_RATELIMIT_ROWS 2
+
+/* Token bucket, refilled lazily when it is looked at. */
+struct ts_ratelimit_cell {
+  /* Monotonic time of the last refill in milliseconds, wraps around. */
+  unsigned int stamp;
+  unsigned int tokens;
+};
+
+typedef struct ts_ratelimit_cell ts_ratelimit_cell_t;
+
+int ts_ratelimit_init(unsigned int, unsigned int, unsigned int);
+void ts_ratelimit_share(unsigned int, unsigned int);
+int ts_ratelimit_allow(const struct sockaddr_storage *);
+
+#endif
@@ -1,25 +1,56 @@
 #ifdef USE_SSL
 
 #include "ssl.h"
+#include "cache.h"
+#include "probes.h"
+#include "stats.h"
 #include "utils.h"
 
+#include <poll.h> /* POLLIN, POLLOUT */
+#include <pthread.h> /* pthread_once() */
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h> /* struct stat */
+#include <unistd.h> /* sysconf() */
 
-static int ts_ssl_loadcert(SSL *s, struct ts_ssl *ssl, const char *file) {
+static void ts_ssl_context_release(void *ptr) {
 
-  ssl->subcontext = SSL_CTX_new(TLSv1_2_server_method());
-  if ( ssl->subcontext == NULL )
+  SSL_CTX_free((SSL_CTX *)ptr);
+}
+
+/* Base context of all sessions, certificate is chosen by servername. */
+static SSL_CTX *ts_ssl_context = NULL;
+static pthread_once_t ts_ssl_once = PTHREAD_ONCE_INIT;
+
+/* Certificate contexts by file, shared by all workers of a process. */
+static ts_cache_t ts_ssl_certs = TS_CACHE_INITIALIZER(TS_SSL_CERT_CACHE_SIZE, ts_ssl_context_release);
+
+static int ts_ssl_loadcert(SSL *s, const char *file, const struct stat *st) {
+
+  ts_cache_entry_t *entry;
+  SSL_CTX *subcontext;
+
+  /* Session takes its own reference, cached context may be retired meanwhile. */
+  entry = ts_cache_find(&ts_ssl_certs, file);
+  if ( entry && ts_cache_valid(entry, st) ) {
+    SSL_set_SSL_CTX(s, (SSL_CTX *)entry->value);
+    return SSL_TLSEXT_ERR_OK;
+  }
+
+  subcontext = SSL_CTX_new(TLSv1_2_server_method());
+  if ( subcontext == NULL )
     return SSL_TLSEXT_ERR_ALERT_FATAL;
 
-  SSL_CTX_set_options(ssl->subcontext, SSL_OP_SINGLE_DH_USE);
-  if ( SSL_CTX_use_certificate_file(ssl->subcontext, file, SSL_FILETYPE_PEM) <= 0 ||
-       SSL_CTX_use_PrivateKey_file(ssl->subcontext, file, SSL_FILETYPE_PEM) <= 0 ) {
+  SSL_CTX_set_options(subcontext, SSL_OP_SINGLE_DH_USE);
+  if ( SSL_CTX_use_certificate_file(subcontext, file, SSL_FILETYPE_PEM) <= 0 ||
+       SSL_CTX_use_PrivateKey_file(subcontext, file, SSL_FILETYPE_PEM) <= 0 ) {
+    SSL_CTX_free(subcontext);
     return SSL_TLSEXT_ERR_ALERT_FATAL;
   }
 
-  SSL_set_SSL_CTX(s, ssl->subcontext);
+  SSL_set_SSL_CTX(s, subcontext);
+  if ( ts_cache_insert(&ts_ssl_certs, file, st, subcontext) == NULL )
+    SSL_CTX_free(subcontext);
   return SSL_TLSEXT_ERR_OK;
 }
 
@@ -33,31 +64,34 @@ static int ts_ssl_servername_cb(SSL *s, int *ad, void *arg) {
   struct stat st;
   int rv;
 
-  ssl = (struct ts_ssl *)arg;
+  (void)arg;
+  ssl = (struct ts_ssl *)SSL_get_app_data(s);
   rv = SSL_TLSEXT_ERR_OK;
 
   /* Get servername from SSL request and save it. */
   ssl->servername = (char *)SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
 
   DEBUG_PRINT("SSL request for hostname: %s.", ssl->servername);
+  TS_PROBE1(sni, ssl->servername);
+
+  if ( ssl->servername == NULL )
+    return SSL_TLSEXT_ERR_NOACK;
 
   /* Allocate memory for servername and transform it. */
-  filename = strdup(ssl->servername);
+  filename = ts_arena_strdup(ssl->arena, ssl->servername);
+  if ( filename == NULL )
+    return SSL_TLSEXT_ERR_ALERT_FATAL;
   dot_count = change_dots_to_underscore(filename);
-  if ( dot_count < 0 ) {
-    rv = SSL_TLSEXT_ERR_ALERT_FATAL;
-    goto free_all;
-  }
+  if ( dot_count < 0 )
+    return SSL_TLSEXT_ERR_ALERT_FATAL;
 
   pem_filename = filename;
 
   /* Check certificate. */
   ts_concatenate_path_filename(file, sizeof(file), ssl->cert_path, pem_filename);
   DEBUG_PRINT("Certificate file: %s", file);
-  if ( stat(file, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG ) {
-    rv = ts_ssl_loadcert(s, ssl, file);
-    goto free_all;
-  }
+  if ( stat(file, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG )
+    return ts_ssl_loadcert(s, file, &st);
 
   /* Check wildcard certificate. */
   if ( dot_count > 1 && *pem_filename != '_' ) {
@@ -67,81 +101,113 @@ static int ts_ssl_servername_cb(SSL *s, int *ad, void *arg) {
     *(--pem_filename) = '+';
     ts_concatenate_path_filename(file, sizeof(file), ssl->cert_path, pem_filename);
     DEBUG_PRINT("Certificate file: %s", file);
-    if ( stat(file, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG ) {
-      rv = ts_ssl_loadcert(s, ssl, file);
-    }
+    if ( stat(file, &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG )
+      return ts_ssl_loadcert(s, file, &st);
   }
 
-free_all:
-  free(filename);
+  TS_STATS_INC(tls_sni_misses);
+  TS_PROBE1(sni_miss, ssl->servername);
   return rv;
 }
 
-int ts_ssl_sendfile(SSL *s, int filefd, int filesize) {
+int ts_ssl_sendfile(SSL *s, int filefd, off_t offset, int count) {
 
-  unsigned char *p, *buf;
-  int remaining_size, len;
+  unsigned char *buf;
+  off_t map_offset;
+  int delta, len;
   int rv;
 
-  buf = mmap(0, (size_t)filesize, PROT_READ, MAP_PRIVATE, filefd, 0);
+  /* Map window of file at page aligned offset. */
+  map_offset = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+  delta = offset - map_offset;
 
-  if ( buf != (unsigned char *)-1 ) {
+  if ( count > MAX_SEND_BUFFER_SIZE )
+    len = MAX_SEND_BUFFER_SIZE;
+  else
+    len = count;
 
-    p = buf;
-	remaining_size = filesize;
-
-    while ( remaining_size > 0 ) {
+  buf = mmap(0, (size_t)(len + delta), PROT_READ, MAP_PRIVATE, filefd, map_offset);
+  if ( buf == (unsigned char *)-1 )
+    return -1;
 
-      if ( remaining_size > MAX_SEND_BUFFER_SIZE )
-        len = MAX_SEND_BUFFER_SIZE;
-      else
-        len = remaining_size;
+  /* Partial and moving buffer writes are enabled, so the window may be mapped again on retry. */
+  rv = SSL_write(s, buf + delta, len);
+  munmap(buf, (size_t)(len + delta));
 
-      rv = SSL_write(s, p, len);
-      if ( rv != len )
-        break;
+  return rv;
+}
 
-      p += rv;
-      remaining_size -= rv;
+int ts_ssl_want(SSL *s, int rv) {
 
-    }
-    munmap(buf, (size_t)filesize);
+  switch ( SSL_get_error(s, rv) ) {
+    case SSL_ERROR_WANT_READ:
+      return POLLIN;
+    case SSL_ERROR_WANT_WRITE:
+      return POLLOUT;
+    default:
+      return 0;
   }
+}
 
-  return 0;
+static void ts_ssl_context_init(void) {
+
+  SSL_library_init();
+
+  ts_ssl_context = SSL_CTX_new(TLSv1_2_server_method());
+  if ( ts_ssl_context == NULL )
+    return;
+
+  SSL_CTX_set_options(ts_ssl_context, SSL_OP_NO_COMPRESSION);
+  SSL_CTX_set_mode(ts_ssl_context, SSL_MODE_RELEASE_BUFFERS | SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_CTX_set_tlsext_servername_callback(ts_ssl_context, ts_ssl_servername_cb);
 }
 
-int ts_ssl_session_init(struct ts_ssl *ssl, int fd) {
+/* Called by every worker, context is created only once per process. */
+int ts_ssl_init(void) {
+
+  pthread_once(&ts_ssl_once, ts_ssl_context_init);
+  return ( ts_ssl_context ) ? 0 : -1;
+}
 
-  ssl->context = SSL_CTX_new(TLSv1_2_server_method());
+/* Certificates are loaded again on the next handshake which asks for them. */
+void ts_ssl_certs_clear(void) {
 
-  if ( ssl->context == NULL )
-    return -1;
+  ts_cache_clear(&ts_ssl_certs);
+}
 
-  SSL_CTX_set_options(ssl->context, SSL_MODE_RELEASE_BUFFERS | SSL_OP_NO_COMPRESSION);
-  SSL_CTX_set_tlsext_servername_callback(ssl->context, ts_ssl_servername_cb);
-  SSL_CTX_set_tlsext_servername_arg(ssl->context, ssl);
+/* Session of connection, handshake is left to caller. */
+int ts_ssl_session_new(struct ts_ssl *ssl, int fd) {
 
-  ssl->s = SSL_new(ssl->context);
-  if ( ssl->s == NULL ) {
-    SSL_CTX_free(ssl->context);
+  if ( ts_ssl_context == NULL )
     return -1;
-  }
 
+  ssl->s = SSL_new(ts_ssl_context);
+  if ( ssl->s == NULL )
+    return -1;
+
+  SSL_set_app_data(ssl->s, ssl);
   SSL_set_fd(ssl->s, fd);
 
-  ssl->subcontext = NULL;
+  return 0;
+}
+
+int ts_ssl_session_init(struct ts_ssl *ssl, int fd) {
+
+  if ( ts_ssl_session_new(ssl, fd) < 0 )
+    return -1;
+
   return SSL_accept(ssl->s);
 }
 
 int ts_ssl_session_close(struct ts_ssl *ssl) {
 
+  if ( ssl->s == NULL )
+    return 0;
+
   SSL_set_shutdown(ssl->s, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
 
   SSL_free(ssl->s);
-  if ( ssl->subcontext != NULL )
-    SSL_CTX_free(ssl->subcontext);
-  SSL_CTX_free(ssl->context);
+  ssl->s = NULL;
   return 0;
 }
 
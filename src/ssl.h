@@ -2,34 +2,40 @@
 #define _TINYSRV_SSL_H
 
 #include "project.h"
+#include "arena.h"
 
 #ifdef USE_SSL
 
 #define MAX_SEND_BUFFER_SIZE 1048576
+/* Certificates kept loaded, one per servername file. */
+#define TS_SSL_CERT_CACHE_SIZE 256
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <sys/types.h> /* off_t */
 
 struct ts_ssl {
   SSL *s;
-  SSL_CTX *context;
-  SSL_CTX *subcontext;
   const char *servername;
   const char *cert_path;
+  ts_arena_t *arena;
 };
 
+int ts_ssl_init(void);
+void ts_ssl_certs_clear(void);
+int ts_ssl_session_new(struct ts_ssl *, int);
 int ts_ssl_session_init(struct ts_ssl *, int);
 int ts_ssl_session_close(struct ts_ssl *);
-int ts_ssl_sendfile(SSL *, int, int);
+int ts_ssl_sendfile(SSL *, int, off_t, int);
+int ts_ssl_want(SSL *, int);
 
 #else
 
 struct ts_ssl {
   void *s;
-  void *context;
-  void *subcontext;
   const char *servername;
   const char *cert_path;
+  ts_arena_t *arena;
 };
 
 #endif /* USE_SSL */
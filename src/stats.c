@@ -0,0 +1,377 @@
+#include "stats.h"
+#include "utils.h"
+
+#include <fcntl.h> /* O_CREAT, O_EXCL, O_RDONLY, O_RDWR */
+#include <stdio.h> /* snprintf() */
+#include <string.h> /* memset() */
+#include <sys/mman.h> /* mmap(), shm_open(), shm_unlink() */
+#include <sys/stat.h> /* struct stat */
+#include <syslog.h>
+#include <time.h> /* time() */
+#include <unistd.h> /* close(), ftruncate() */
+
+static ts_stats_t ts_stats_local;
+/* Counters of worker thread when there is no shared segment. */
+static __thread ts_stats_t ts_stats_thread;
+
+/* Every worker thread writes to its own slot. */
+__thread ts_stats_t *ts_stats = &ts_stats_local;
+ts_stats_segment_t *ts_stats_segment = NULL;
+/* Inode of own segment, the name may be taken over by an upgraded server. */
+static ino_t ts_stats_segment_ino;
+
+/* Label values indexed by response_enum. */
+static const char *const ts_stats_response_names[SEND_RESPONSE_TYPES] = {
+  "css", "file", "gif", "html", "ico", "jpg", "webp", "js", "png", "swf", "txt",
+  "no_ext", "unk_ext", "204", "redirect", "jsclose", "stats", "nossl", "error"
+};
+
+/* Label values indexed by ts_close_type. */
+static const char *const ts_stats_close_names[TS_CLOSE_TYPES] = {
+  "server", "client", "deadline", "reset"
+};
+
+static unsigned int ts_histogram_index(unsigned long long value) {
+
+  unsigned int shift, index;
+
+  if ( value < TS_HISTOGRAM_SUB )
+    return value;
+
+  /* Position of the most significant bit selects power of two, next bits select linear bucket. */
+  shift = 63 - __builtin_clzll(value) - TS_HISTOGRAM_SUB_BITS;
+  index = (shift + 1) * TS_HISTOGRAM_SUB + (unsigned int)(value >> shift) - TS_HISTOGRAM_SUB;
+  if ( index >= TS_HISTOGRAM_BUCKETS )
+    index = TS_HISTOGRAM_BUCKETS - 1;
+  return index;
+}
+
+/* Middle of bucket values. */
+static unsigned long long ts_histogram_value(unsigned int index) {
+
+  unsigned int shift;
+
+  if ( index < TS_HISTOGRAM_SUB )
+    return index;
+
+  shift = index / TS_HISTOGRAM_SUB - 1;
+  return ((unsigned long long)(TS_HISTOGRAM_SUB + index % TS_HISTOGRAM_SUB) << shift) + ((1ULL << shift) >> 1);
+}
+
+void ts_histogram_record(ts_histogram_t *histogram, unsigned long long value) {
+
+  unsigned int index;
+
+  index = ts_histogram_index(value);
+  TS_STATS_STORE(histogram->bucket[index], histogram->bucket[index] + 1);
+  TS_STATS_STORE(histogram->sum, histogram->sum + value);
+  TS_STATS_STORE(histogram->count, histogram->count + 1);
+}
+
+unsigned long long ts_histogram_quantile(const ts_histogram_t *histogram, double quantile) {
+
+  unsigned long long target, cumulative;
+  unsigned int index;
+
+  if ( histogram->count == 0 )
+    return 0;
+
+  target = (unsigned long long)(quantile * histogram->count);
+  if ( target == 0 )
+    target = 1;
+
+  cumulative = 0;
+  for ( index = 0; index < TS_HISTOGRAM_BUCKETS; index++ ) {
+    cumulative += histogram->bucket[index];
+    if ( cumulative >= target )
+      break;
+  }
+
+  return ts_histogram_value(index);
+}
+
+void ts_stats_status(int status_code) {
+
+  unsigned int i;
+
+  for ( i = 0; http_statuses[i].status_code; i++ )
+    if ( http_statuses[i].status_code == status_code )
+      break;
+  TS_STATS_INC(status[i]);
+}
+
+static int ts_stats_format_histogram(char *buf, int len, const char *name, const ts_histogram_t *histogram) {
+
+  unsigned long long cumulative;
+  unsigned int index, bucket, power;
+  int n, length;
+
+  length = snprintf(buf, len, "# TYPE %s_%s histogram\n", PROGRAM_NAME, name);
+
+  /*
+  Export only power of two boundaries from 1 us to 64 s. Buckets below the one
+  starting at 2^p hold values under 2^p, latencies are whole microseconds, so
+  the inclusive bound of le is 2^p - 1.
+  */
+  cumulative = 0;
+  bucket = 0;
+  for ( power = 0; power <= 26 && length < len; power++ ) {
+    index = ts_histogram_index(1ULL << power);
+    while ( bucket < index )
+      cumulative += histogram->bucket[bucket++];
+    n = snprintf(buf + length, len - length, "%s_%s_bucket{le=\"%.6f\"} %llu\n",
+      PROGRAM_NAME, name, (double)((1ULL << power) - 1) / 1e6, cumulative);
+    length += n;
+  }
+
+  if ( length < len )
+    length += snprintf(buf + length, len - length,
+      "%s_%s_bucket{le=\"+Inf\"} %llu\n%s_%s_sum %.6f\n%s_%s_count %llu\n",
+      PROGRAM_NAME, name, histogram->count,
+      PROGRAM_NAME, name, (double)histogram->sum / 1e6,
+      PROGRAM_NAME, name, histogram->count);
+
+  return length;
+}
+
+/* Write statistics in Prometheus text format, returns -1 if buffer is too small. */
+int ts_stats_format(const ts_stats_t *stats, char *buf, int len) {
+
+  unsigned int i;
+  int length;
+
+  length = snprintf(buf, len, "# TYPE %s_responses_total counter\n", PROGRAM_NAME);
+  for ( i = 0; i < SEND_RESPONSE_TYPES && length < len; i++ )
+    length += snprintf(buf + length, len - length, "%s_responses_total{type=\"%s\"} %llu\n",
+      PROGRAM_NAME, ts_stats_response_names[i], stats->responses[i]);
+
+  if ( length < len )
+    length += snprintf(buf + length, len - length, "# TYPE %s_http_status_total counter\n", PROGRAM_NAME);
+  for ( i = 0; i < HTTP_STATUSES && length < len; i++ ) {
+    if ( http_statuses[i].status_code )
+      length += snprintf(buf + length, len - length, "%s_http_status_total{code=\"%d\"} %llu\n",
+        PROGRAM_NAME, http_statuses[i].status_code, stats->status[i]);
+    else
+      length += snprintf(buf + length, len - length, "%s_http_status_total{code=\"other\"} %llu\n",
+        PROGRAM_NAME, stats->status[i]);
+  }
+
+  if ( length < len )
+    length += snprintf(buf + length, len - length, "# TYPE %s_connections_closed_total counter\n", PROGRAM_NAME);
+  for ( i = 0; i < TS_CLOSE_TYPES && length < len; i++ )
+    length += snprintf(buf + length, len - length, "%s_connections_closed_total{by=\"%s\"} %llu\n",
+      PROGRAM_NAME, ts_stats_close_names[i], stats->closes[i]);
+
+  if ( length < len )
+    length += snprintf(buf + length, len - length,
+      "# TYPE %s_tls_handshakes_total counter\n"
+      "%s_tls_handshakes_total{result=\"ok\"} %llu\n"
+      "%s_tls_handshakes_total{result=\"failure\"} %llu\n"
+      "# TYPE %s_tls_sni_misses_total counter\n"
+      "%s_tls_sni_misses_total %llu\n"
+      "# TYPE %s_tls_handshakes_pending gauge\n"
+      "%s_tls_handshakes_pending %llu\n"
+      "# TYPE %s_bytes_sent_total counter\n"
+      "%s_bytes_sent_total %llu\n"
+      "# TYPE %s_connections_accepted_total counter\n"
+      "%s_connections_accepted_total %llu\n"
+      "# TYPE %s_connections_active gauge\n"
+      "%s_connections_active %llu\n"
+      "# TYPE %s_accept_wakeups_total counter\n"
+      "%s_accept_wakeups_total %llu\n"
+      "# TYPE %s_accept_empty_total counter\n"
+      "%s_accept_empty_total %llu\n"
+      "# TYPE %s_connections_shed_total counter\n"
+      "%s_connections_shed_total %llu\n"
+      "# TYPE %s_connections_rate_limited_total counter\n"
+      "%s_connections_rate_limited_total %llu\n"
+      "# TYPE %s_accept_pauses_total counter\n"
+      "%s_accept_pauses_total %llu\n"
+      "# TYPE %s_busy_seconds_total counter\n"
+      "%s_busy_seconds_total %.6f\n"
+      "# TYPE %s_access_log_drops_total counter\n"
+      "%s_access_log_drops_total %llu\n",
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->tls_handshakes,
+      PROGRAM_NAME, stats->tls_handshake_failures,
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->tls_sni_misses,
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->tls_handshakes_pending,
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->bytes_sent,
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->connections_accepted,
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->connections_active,
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->accept_wakeups,
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->accept_empty,
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->connections_shed,
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->connections_limited,
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->accept_pauses,
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->busy_us / 1e6,
+      PROGRAM_NAME,
+      PROGRAM_NAME, stats->log_drops);
+
+  if ( length < len )
+    length += ts_stats_format_histogram(buf + length, len - length, "first_byte_seconds", &stats->first_byte_latency);
+  if ( length < len )
+    length += ts_stats_format_histogram(buf + length, len - length, "request_seconds", &stats->request_latency);
+
+  return ( length < len ) ? length : -1;
+}
+
+/* Create segment with a slot for every worker, done by supervisor before workers are started. */
+int ts_stats_segment_create(const char *name, unsigned int workers) {
+
+  ts_stats_segment_t *segment;
+  struct stat st;
+  size_t size;
+  int fd;
+
+  size = sizeof(ts_stats_segment_t) + workers * sizeof(ts_stats_t);
+
+  /* Segment of a server being replaced is still mapped by its workers, it must not be truncated. */
+  shm_unlink(name);
+  fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if ( fd < 0 ) {
+    syslog(LOG_WARNING, "Cannot create statistics segment %s: %m.", name);
+    return -1;
+  }
+
+  if ( fstat(fd, &st) < 0 || ftruncate(fd, size) < 0 ) {
+    syslog(LOG_WARNING, "Cannot resize statistics segment %s: %m.", name);
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+
+  segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if ( segment == MAP_FAILED ) {
+    syslog(LOG_WARNING, "Cannot map statistics segment %s: %m.", name);
+    shm_unlink(name);
+    return -1;
+  }
+
+  memset(segment, 0, size);
+  ts_stats_segment_ino = st.st_ino;
+  segment->version = TS_STATS_VERSION;
+  segment->workers = workers;
+  segment->started = time(NULL);
+  /* Readers check magic last. */
+  __atomic_store_n(&segment->magic, TS_STATS_MAGIC, __ATOMIC_RELEASE);
+
+  ts_stats_segment = segment;
+  return 0;
+}
+
+/* Map existing segment read only, used by readers. */
+ts_stats_segment_t *ts_stats_segment_open(const char *name) {
+
+  ts_stats_segment_t *segment;
+  struct stat st;
+  int fd;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if ( fd < 0 )
+    return NULL;
+
+  if ( fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ts_stats_segment_t) ) {
+    close(fd);
+    return NULL;
+  }
+
+  segment = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if ( segment == MAP_FAILED )
+    return NULL;
+
+  if ( __atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != TS_STATS_MAGIC || segment->version != TS_STATS_VERSION ||
+       sizeof(ts_stats_segment_t) + segment->workers * sizeof(ts_stats_t) > (size_t)st.st_size ) {
+    munmap(segment, st.st_size);
+    return NULL;
+  }
+
+  return segment;
+}
+
+void ts_stats_segment_remove(const char *name) {
+
+  struct stat st;
+  int fd;
+
+  if ( ts_stats_segment == NULL )
+    return;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if ( fd < 0 )
+    return;
+  if ( fstat(fd, &st) == 0 && st.st_ino == ts_stats_segment_ino )
+    shm_unlink(name);
+  close(fd);
+}
+
+/* Point worker counters to its slot, counters survive restart of the worker. */
+void ts_stats_attach(unsigned int index) {
+
+  if ( ts_stats_segment && index < ts_stats_segment->workers )
+    ts_stats = &ts_stats_segment->slot[index];
+  else
+    ts_stats = &ts_stats_thread;
+
+  /* Connections of previous instance of the worker are gone. */
+  TS_STATS_STORE(ts_stats->connections_active, 0);
+  TS_STATS_STORE(ts_stats->tls_handshakes_pending, 0);
+  TS_HEARTBEAT();
+}
+
+/* Supervisor tells workers how many of them run. */
+void ts_stats_publish_active(unsigned int active) {
+
+  if ( ts_stats_segment )
+    __atomic_store_n(&ts_stats_segment->active, active, __ATOMIC_RELAXED);
+}
+
+/* Workers running, given count when the pool is not resized or not published yet. */
+unsigned int ts_stats_active(unsigned int workers) {
+
+  unsigned int active;
+
+  active = ( ts_stats_segment ) ? __atomic_load_n(&ts_stats_segment->active, __ATOMIC_RELAXED) : 0;
+  return ( active ) ? active : workers;
+}
+
+void ts_stats_sum(ts_stats_t *total, const ts_stats_t *stats) {
+
+  unsigned long long *dst;
+  const unsigned long long *src;
+  unsigned int i;
+
+  dst = (unsigned long long *)total;
+  src = (const unsigned long long *)stats;
+  for ( i = 0; i < TS_STATS_COUNTERS; i++ )
+    dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+/* Sum counters of all workers, or return own counters without shared segment. */
+void ts_stats_aggregate(ts_stats_t *total) {
+
+  unsigned int i;
+
+  memset(total, 0, sizeof(ts_stats_t));
+
+  if ( ts_stats_segment == NULL ) {
+    ts_stats_sum(total, ts_stats);
+    return;
+  }
+
+  for ( i = 0; i < ts_stats_segment->workers; i++ )
+    ts_stats_sum(total, &ts_stats_segment->slot[i]);
+}
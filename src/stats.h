@@ -0,0 +1,116 @@
+#ifndef _TINYSRV_STATS_H
+#define _TINYSRV_STATS_H
+
+#include "project.h"
+#include "http.h"
+
+/* Histogram has 2^TS_HISTOGRAM_SUB_BITS linear buckets in every power of two. */
+#define TS_HISTOGRAM_SUB_BITS 3
+#define TS_HISTOGRAM_SUB (1 << TS_HISTOGRAM_SUB_BITS)
+/* Values up to 2^32 microseconds. */
+#define TS_HISTOGRAM_BUCKETS ((32 - TS_HISTOGRAM_SUB_BITS + 1) * TS_HISTOGRAM_SUB)
+
+#define TS_STATS_BUFFER_SIZE 16384
+
+#define TS_STATS_MAGIC 0x74737374
+#define TS_STATS_VERSION 9
+
+/* Who closed connection, server closing first leaves it in TIME_WAIT. */
+enum ts_close_type {
+  TS_CLOSE_SERVER,
+  TS_CLOSE_CLIENT,
+  /* Client did not close before deadline, server closed. */
+  TS_CLOSE_DEADLINE,
+  TS_CLOSE_RESET,
+  TS_CLOSE_TYPES
+};
+
+struct ts_histogram {
+  unsigned long long count;
+  /* Sum of recorded values in microseconds. */
+  unsigned long long sum;
+  unsigned long long bucket[TS_HISTOGRAM_BUCKETS];
+};
+
+typedef struct ts_histogram ts_histogram_t;
+
+/*
+Counters of single worker, there is always only one writer. Structure contains
+only unsigned long long counters, so it can be summed as an array.
+*/
+struct ts_stats {
+  unsigned long long responses[SEND_RESPONSE_TYPES];
+  /* Indexed as http_statuses, the last one counts unknown status codes. */
+  unsigned long long status[HTTP_STATUSES];
+  unsigned long long tls_handshakes;
+  unsigned long long tls_handshake_failures;
+  unsigned long long tls_sni_misses;
+  /* Handshakes in progress in event loop of worker. */
+  unsigned long long tls_handshakes_pending;
+  unsigned long long bytes_sent;
+  unsigned long long connections_accepted;
+  unsigned long long connections_active;
+  /* Returns from waiting for connections, and those which found no connection to accept. */
+  unsigned long long accept_wakeups;
+  unsigned long long accept_empty;
+  /* Connections refused over the caps and over rate of client, and pauses of accepting when out of descriptors. */
+  unsigned long long connections_shed;
+  unsigned long long connections_limited;
+  unsigned long long closes[TS_CLOSE_TYPES];
+  unsigned long long accept_pauses;
+  /* Time spent serving connections, not waiting for them, in microseconds. */
+  unsigned long long busy_us;
+  /* Monotonic time of the last sign of life in milliseconds, meaningless when summed. */
+  unsigned long long heartbeat;
+  unsigned long long log_drops;
+  /* Accept to the first byte of response. */
+  ts_histogram_t first_byte_latency;
+  /* Accept to close. */
+  ts_histogram_t request_latency;
+} __attribute__((aligned(TS_CACHE_LINE)));
+
+typedef struct ts_stats ts_stats_t;
+
+#define TS_STATS_COUNTERS (sizeof(ts_stats_t) / sizeof(unsigned long long))
+
+/*
+Shared memory segment created by supervisor, every worker writes to its own slot.
+Slots are cache line aligned, so workers never share a cache line.
+*/
+struct ts_stats_segment {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int workers;
+  /* Workers running, published by supervisor as the pool is resized, 0 until it is. */
+  unsigned int active;
+  long long started;
+  ts_stats_t slot[];
+};
+
+typedef struct ts_stats_segment ts_stats_segment_t;
+
+extern __thread ts_stats_t *ts_stats;
+extern ts_stats_segment_t *ts_stats_segment;
+
+/* Single writer does not need atomic read-modify-write, store is atomic for readers. */
+#define TS_STATS_STORE(var, value) __atomic_store_n(&(var), (value), __ATOMIC_RELAXED)
+#define TS_STATS_ADD(field, n) TS_STATS_STORE(ts_stats->field, ts_stats->field + (n))
+#define TS_STATS_INC(field) TS_STATS_ADD(field, 1)
+/* Worker tells supervisor it is not stalled, caller includes utils.h. */
+#define TS_HEARTBEAT() TS_STATS_STORE(ts_stats->heartbeat, ts_clock_ms())
+
+void ts_histogram_record(ts_histogram_t *, unsigned long long);
+unsigned long long ts_histogram_quantile(const ts_histogram_t *, double);
+void ts_stats_status(int);
+int ts_stats_format(const ts_stats_t *, char *, int);
+
+int ts_stats_segment_create(const char *, unsigned int);
+ts_stats_segment_t *ts_stats_segment_open(const char *);
+void ts_stats_segment_remove(const char *);
+void ts_stats_attach(unsigned int);
+void ts_stats_publish_active(unsigned int);
+unsigned int ts_stats_active(unsigned int);
+void ts_stats_sum(ts_stats_t *, const ts_stats_t *);
+void ts_stats_aggregate(ts_stats_t *);
+
+#endif
@@ -0,0 +1,148 @@
+#include "teardown.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdlib.h> /* calloc() */
+#include <sys/epoll.h> /* epoll_ctl() */
+#include <sys/socket.h> /* recv(), shutdown() */
+#include <syslog.h>
+#include <unistd.h> /* close() */
+
+/*
+Slots of worker. Free ones are linked through next, waiting ones from head to
+tail in order of deadlines. Worker goes on serving while clients read their
+responses and close.
+*/
+static __thread ts_teardown_slot_t *ts_teardown_slots = NULL;
+static __thread ts_teardown_slot_t *ts_teardown_free;
+static __thread ts_teardown_slot_t *ts_teardown_head;
+static __thread ts_teardown_slot_t *ts_teardown_tail;
+static __thread int ts_teardown_epfd;
+
+/* Allocate slots of worker whose sockets are registered with epfd. */
+int ts_teardown_init(int epfd) {
+
+  unsigned int i;
+
+  ts_teardown_slots = calloc(TS_TEARDOWN_MAX, sizeof(ts_teardown_slot_t));
+  if ( ts_teardown_slots == NULL ) {
+    syslog(LOG_WARNING, "Cannot allocate teardowns, connections are closed by server.");
+    return -1;
+  }
+
+  for ( i = 0; i + 1 < TS_TEARDOWN_MAX; i++ )
+    ts_teardown_slots[i].next = &ts_teardown_slots[i + 1];
+  ts_teardown_free = ts_teardown_slots;
+  ts_teardown_head = NULL;
+  ts_teardown_tail = NULL;
+  ts_teardown_epfd = epfd;
+
+  return 0;
+}
+
+/* Event data of epoll point to slot of teardown. */
+int ts_teardown_owns(const void *ptr) {
+
+  return ts_teardown_slots != NULL &&
+    (const ts_teardown_slot_t *)ptr >= ts_teardown_slots &&
+    (const ts_teardown_slot_t *)ptr < ts_teardown_slots + TS_TEARDOWN_MAX;
+}
+
+/* Connection is closed and counted by who closed it, then its slot is free again. */
+static void ts_teardown_finish(ts_teardown_slot_t *teardown, enum ts_close_type type) {
+
+  epoll_ctl(ts_teardown_epfd, EPOLL_CTL_DEL, teardown->fd, NULL);
+
+  if ( teardown->prev )
+    teardown->prev->next = teardown->next;
+  else
+    ts_teardown_head = teardown->next;
+  if ( teardown->next )
+    teardown->next->prev = teardown->prev;
+  else
+    ts_teardown_tail = teardown->prev;
+
+  if ( type == TS_CLOSE_DEADLINE )
+    shutdown(teardown->fd, SHUT_RDWR);
+  close(teardown->fd);
+  TS_STATS_INC(closes[type]);
+
+  teardown->next = ts_teardown_free;
+  ts_teardown_free = teardown;
+}
+
+/* Client closes once it has read the response, its FIN is end of stream. Data are discarded. */
+void ts_teardown_event(void *ptr) {
+
+  ts_teardown_slot_t *teardown;
+  char buf[512];
+  int rv;
+
+  teardown = (ts_teardown_slot_t *)ptr;
+
+  rv = recv(teardown->fd, buf, sizeof(buf), MSG_DONTWAIT);
+  if ( rv == 0 )
+    ts_teardown_finish(teardown, teardown->closed);
+  else if ( rv < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+    ts_teardown_finish(teardown, TS_CLOSE_DEADLINE);
+}
+
+/*
+Take served connection into the event loop until client closes or wait
+milliseconds pass, closed is counted when it does. Returns -1 when server
+should close it right away.
+*/
+int ts_teardown_start(int fd, int wait, enum ts_close_type closed) {
+
+  ts_teardown_slot_t *teardown, *cur;
+  struct epoll_event event;
+
+  teardown = ts_teardown_free;
+  if ( teardown == NULL )
+    return -1;
+
+  event.events = EPOLLIN | EPOLLRDHUP;
+  event.data.ptr = teardown;
+  if ( epoll_ctl(ts_teardown_epfd, EPOLL_CTL_ADD, fd, &event) < 0 )
+    return -1;
+
+  ts_teardown_free = teardown->next;
+  teardown->fd = fd;
+  teardown->closed = closed;
+  teardown->deadline = ts_clock_ms() + wait;
+
+  /* Listeners mostly share the wait, so the new deadline is usually the last one. */
+  for ( cur = ts_teardown_tail; cur && cur->deadline > teardown->deadline; cur = cur->prev );
+  teardown->prev = cur;
+  teardown->next = ( cur ) ? cur->next : ts_teardown_head;
+  if ( teardown->next )
+    teardown->next->prev = teardown;
+  else
+    ts_teardown_tail = teardown;
+  if ( cur )
+    cur->next = teardown;
+  else
+    ts_teardown_head = teardown;
+
+  /* Client has often closed already. */
+  ts_teardown_event(teardown);
+  return 0;
+}
+
+/*
+Connections whose client did not close in time are closed by server.
+Returns milliseconds until the next deadline, -1 when no connection waits.
+*/
+int ts_teardown_expire(void) {
+
+  long long now;
+
+  if ( ts_teardown_head == NULL )
+    return -1;
+
+  now = ts_clock_ms();
+  while ( ts_teardown_head && ts_teardown_head->deadline <= now )
+    ts_teardown_finish(ts_teardown_head, TS_CLOSE_DEADLINE);
+
+  return ts_teardown_head ? (int)(ts_teardown_head->deadline - now) : -1;
+}
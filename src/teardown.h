@@ -0,0 +1,33 @@
+#ifndef _TINYSRV_TEARDOWN_H
+#define _TINYSRV_TEARDOWN_H
+
+#include "project.h"
+#include "stats.h"
+
+/* Connections of every worker waiting for client to close, further ones are closed by server. */
+#define TS_TEARDOWN_MAX 4096
+
+/*
+Served connection waiting in the event loop of worker for client to close
+first, with -T wait, or for the rest of request body after server closed its
+side. Waiting connections are linked in order of deadlines.
+*/
+struct ts_teardown_slot {
+  int fd;
+  /* Counted when client closes, in time. */
+  enum ts_close_type closed;
+  /* Monotonic deadline in milliseconds. */
+  long long deadline;
+  struct ts_teardown_slot *prev;
+  struct ts_teardown_slot *next;
+};
+
+typedef struct ts_teardown_slot ts_teardown_slot_t;
+
+int ts_teardown_init(int);
+int ts_teardown_start(int, int, enum ts_close_type);
+int ts_teardown_owns(const void *);
+void ts_teardown_event(void *);
+int ts_teardown_expire(void);
+
+#endif
@@ -0,0 +1,65 @@
+#include "trace.h"
+
+#ifdef TRACE
+
+#include "stats.h"
+
+#include <signal.h> /* sigaction(), sigemptyset(), struct sigaction */
+#include <syslog.h>
+
+/* Incremented by signal, every worker dumps when it sees a new value. */
+volatile int trace_requested = 0;
+__thread int trace_dumped = 0;
+
+static const char *const trace_phase_names[TRACE_PHASES] = {
+  "accept", "tls_handshake", "read", "parse", "serve", "file", "redirect", "jsclose", "204", "write", "close"
+};
+
+/* Durations in nanoseconds, per worker thread. */
+static __thread ts_histogram_t trace_histograms[TRACE_PHASES];
+
+void trace_record(trace_phase phase, long long duration) {
+
+  ts_histogram_record(&trace_histograms[phase], duration);
+}
+
+static void trace_signal_handler(int signum) {
+
+  (void)signum;
+  trace_requested++;
+}
+
+void trace_setup_signal_handler(void) {
+
+  struct sigaction sa;
+
+  sa.sa_flags = SA_RESTART;
+  sa.sa_handler = trace_signal_handler;
+  sigemptyset(&sa.sa_mask);
+  if ( sigaction(SIGUSR1, &sa, NULL) < 0 )
+    syslog(LOG_WARNING, "Trace signal handler could not be set: %m.");
+}
+
+/* Called from worker loop, never from signal handler. */
+void trace_dump(void) {
+
+  const ts_histogram_t *histogram;
+  unsigned int phase;
+
+  trace_dumped = trace_requested;
+
+  for ( phase = 0; phase < TRACE_PHASES; phase++ ) {
+    histogram = &trace_histograms[phase];
+    if ( histogram->count == 0 )
+      continue;
+    syslog(LOG_INFO, "Trace %-13s count %llu mean %.3f p50 %.3f p90 %.3f p99 %.3f p999 %.3f us",
+      trace_phase_names[phase], histogram->count,
+      (double)histogram->sum / histogram->count / 1e3,
+      ts_histogram_quantile(histogram, 0.5) / 1e3,
+      ts_histogram_quantile(histogram, 0.9) / 1e3,
+      ts_histogram_quantile(histogram, 0.99) / 1e3,
+      ts_histogram_quantile(histogram, 0.999) / 1e3);
+  }
+}
+
+#endif /* TRACE */
@@ -0,0 +1,39 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "project.h"
+
+#ifdef TRACE
+
+typedef enum {
+  TRACE_ACCEPT,
+  TRACE_TLS_HANDSHAKE,
+  TRACE_READ,
+  TRACE_PARSE,
+  TRACE_SERVE,
+  TRACE_FILE,
+  TRACE_REDIRECT,
+  TRACE_JSCLOSE,
+  TRACE_204,
+  TRACE_WRITE,
+  TRACE_CLOSE,
+  TRACE_PHASES
+} trace_phase;
+
+extern volatile int trace_requested;
+extern __thread int trace_dumped;
+
+void trace_record(trace_phase, long long);
+void trace_setup_signal_handler(void);
+void trace_dump(void);
+
+ #define TRACE_BEGIN(var) long long var = ts_clock_ns()
+ #define TRACE_END(phase, var) trace_record(phase, ts_clock_ns() - (var))
+ #define TRACE_DUMP_IF_REQUESTED() if ( trace_requested != trace_dumped ) trace_dump()
+#else
+ #define TRACE_BEGIN(var)
+ #define TRACE_END(phase, var)
+ #define TRACE_DUMP_IF_REQUESTED()
+#endif
+
+#endif
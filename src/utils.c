@@ -1,7 +1,10 @@
 #include "utils.h"
+#include "project.h"
 
 #include <ctype.h> /* isprint(), isdigit(), tolower(), isalnum() */
-#include <string.h> /* strlen() */
+#include <pthread.h> /* pthread_once() */
+#include <string.h> /* memset(), strlen() */
+#include <time.h> /* clock_gettime() */
 
 char *tu_strtok(char **str, unsigned int *match_length, const char *delimiters) {
 
@@ -196,6 +199,175 @@ void decode_url(char *to, const char *from) {
   *to = 0;
 }
 
+int ts_ac_build(ts_ac_t *ac, const char *const *patterns, int count, int nocase) {
+
+  unsigned char fail[TS_AC_MAX_STATES];
+  unsigned char queue[TS_AC_MAX_STATES];
+  unsigned int head, tail;
+  int i, c, state, states, child;
+  const char *p;
+
+  if ( count > 8 )
+    return -1;
+
+  memset(ac, 0, sizeof(ts_ac_t));
+
+  /* Build trie, zero transition means no child since root is never a child. */
+  states = 1;
+  for ( i = 0; i < count; i++ ) {
+    state = 0;
+    for ( p = patterns[i]; *p; p++ ) {
+      c = ( nocase ) ? tolower(*p) : (unsigned char)*p;
+      if ( ac->next[state][c] == 0 ) {
+        if ( states == TS_AC_MAX_STATES )
+          return -1;
+        ac->next[state][c] = states++;
+      }
+      state = ac->next[state][c];
+    }
+    ac->output[state] |= 1 << i;
+  }
+
+  /* Resolve missing transitions through failure links in breadth first order. */
+  head = tail = 0;
+  for ( c = 0; c < 256; c++ ) {
+    child = ac->next[0][c];
+    if ( child ) {
+      fail[child] = 0;
+      queue[tail++] = child;
+    }
+  }
+
+  while ( head < tail ) {
+    state = queue[head++];
+    ac->output[state] |= ac->output[fail[state]];
+    for ( c = 0; c < 256; c++ ) {
+      child = ac->next[state][c];
+      if ( child ) {
+        fail[child] = ac->next[fail[state]][c];
+        queue[tail++] = child;
+      }
+      else
+        ac->next[state][c] = ac->next[fail[state]][c];
+    }
+  }
+
+  if ( nocase )
+    for ( state = 0; state < states; state++ )
+      for ( c = 'A'; c <= 'Z'; c++ )
+        ac->next[state][c] = ac->next[state][tolower(c)];
+
+  return 0;
+}
+
+/* Patterns in raw query which mark a tracker link. */
+static const char *const redirect_triggers[] = { "=http", "%5cx3dhttp" };
+/* Patterns in decoded query, http is preferred. */
+static const char *const redirect_schemes[] = { "http://", "https://" };
+
+static ts_ac_t redirect_trigger_ac, redirect_scheme_ac;
+static pthread_once_t redirect_once = PTHREAD_ONCE_INIT;
+
+static void redirect_prepare(void) {
+
+  ts_ac_build(&redirect_trigger_ac, redirect_triggers, 2, 1);
+  ts_ac_build(&redirect_scheme_ac, redirect_schemes, 2, 0);
+}
+
+struct redirect_scan {
+  ts_ac_t *schemes;
+  unsigned char state;
+  char *to;
+  char *last[2];
+};
+
+static void redirect_emit(struct redirect_scan *scan, char ch) {
+
+  *scan->to = ch;
+  scan->state = scan->schemes->next[scan->state][(unsigned char)ch];
+  if ( scan->schemes->output[scan->state] & 1 )
+    scan->last[0] = scan->to - 6;
+  if ( scan->schemes->output[scan->state] & 2 )
+    scan->last[1] = scan->to - 7;
+  scan->to++;
+}
+
+/*
+Double decode query in place and find the last embedded URL in a single pass.
+Returns NULL if query does not look like tracker link.
+*/
+char *find_redirect_url(char *query) {
+
+  struct redirect_scan scan;
+  unsigned char trigger_state, matched;
+  char *from;
+  char pending[2];
+  int i, pending_length;
+  char ch;
+
+  /* Worker threads may race for the first request. */
+  pthread_once(&redirect_once, redirect_prepare);
+
+  scan.schemes = &redirect_scheme_ac;
+  scan.state = 0;
+  scan.to = query;
+  scan.last[0] = scan.last[1] = NULL;
+
+  trigger_state = 0;
+  matched = 0;
+  pending_length = 0;
+
+  from = query;
+  while ( *from ) {
+
+    /* Triggers are searched in raw query, escape sequence is fed char by char. */
+    trigger_state = redirect_trigger_ac.next[trigger_state][(unsigned char)*from];
+    matched |= redirect_trigger_ac.output[trigger_state];
+
+    /* First decode reads ahead in input, which is never behind output. */
+    if ( *from == '%' && isxdigit(*(from + 1)) && isxdigit(*(from + 2)) ) {
+      for ( i = 1; i < 3; i++ ) {
+        trigger_state = redirect_trigger_ac.next[trigger_state][(unsigned char)*(from + i)];
+        matched |= redirect_trigger_ac.output[trigger_state];
+      }
+      ch = from_hex(*(from + 1)) << 4 | from_hex(*(from + 2));
+      from += 3;
+    }
+    else
+      ch = *from++;
+
+    /* Second decode keeps partial escape sequence aside. */
+    if ( pending_length == 2 && isxdigit(ch) ) {
+      redirect_emit(&scan, from_hex(pending[1]) << 4 | from_hex(ch));
+      pending_length = 0;
+      continue;
+    }
+    if ( pending_length == 1 && isxdigit(ch) ) {
+      pending[pending_length++] = ch;
+      continue;
+    }
+
+    /* Broken escape sequence is output as is. */
+    for ( i = 0; i < pending_length; i++ )
+      redirect_emit(&scan, pending[i]);
+    pending_length = 0;
+
+    if ( ch == '%' )
+      pending[pending_length++] = ch;
+    else
+      redirect_emit(&scan, ch);
+  }
+
+  for ( i = 0; i < pending_length; i++ )
+    redirect_emit(&scan, pending[i]);
+  *scan.to = 0;
+
+  if ( !matched )
+    return NULL;
+
+  return ( scan.last[0] ) ? scan.last[0] : scan.last[1];
+}
+
 int change_dots_to_underscore(char *const str) {
 
   char *strp;
@@ -272,3 +444,19 @@ int ts_concatenate_path_filename(char *buf, int buflen, const char *path, const
 
   return 0;
 }
+
+long long ts_clock_ms(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long ts_clock_ns(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
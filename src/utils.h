@@ -1,6 +1,17 @@
 #ifndef _UTILS_H
 #define _UTILS_H
 
+#define TS_AC_MAX_STATES 32
+
+/* Aho-Corasick automaton compiled to DFA, up to 8 patterns. */
+struct ts_ac {
+  unsigned char next[TS_AC_MAX_STATES][256];
+  /* Bit mask of patterns which end in state. */
+  unsigned char output[TS_AC_MAX_STATES];
+};
+
+typedef struct ts_ac ts_ac_t;
+
 char *tu_strtok(char **, unsigned int *, const char *);
 char *tu_strbtok(char **, unsigned int *, const char *);
 
@@ -8,8 +19,12 @@ unsigned int find_delimiter(const char *startptr, char **endptr, const char *del
 char *strnstr(const char *str, const char *needle, int len);
 char *strstr_last(const char* const str1, const char* const str2);
 void decode_url(char *to, const char *from);
+int ts_ac_build(ts_ac_t *, const char *const *, int, int);
+char *find_redirect_url(char *query);
 int change_dots_to_underscore(char *const);
 int is_safe_filename(const char *const str);
 int ts_concatenate_path_filename(char *, int, const char *, const char *);
+long long ts_clock_ms(void);
+long long ts_clock_ns(void);
 
 #endif
@@ -0,0 +1,204 @@
+#include "project.h"
+#include "stats.h"
+
+#include <signal.h> /* sigaction(), sigemptyset(), struct sigaction */
+#include <stdio.h>
+#include <stdlib.h> /* atoi(), posix_memalign(), EXIT_FAILURE */
+#include <string.h> /* memcpy(), memset() */
+#include <time.h> /* nanosleep() */
+
+volatile int terminated;
+
+struct ts_stat_options {
+  const char *name;
+  int interval;
+  int count;
+  int per_worker;
+};
+
+static void signal_handler(int signum) {
+
+  (void)signum;
+  terminated = 1;
+}
+
+static void usage(void) {
+
+  fprintf(stderr,
+    "Usage: %s-stat [-n name] [-i seconds] [-c count] [-w]\n"
+    "  -n name     shared memory segment name (default /%s)\n"
+    "  -i seconds  refresh interval (default 1)\n"
+    "  -c count    number of refreshes, 0 runs until interrupted (default 0)\n"
+    "  -w          show every worker\n", PROGRAM_NAME, PROGRAM_NAME);
+}
+
+/* Difference of two snapshots, counters are monotonic except active connections. */
+static void ts_stats_delta(ts_stats_t *delta, const ts_stats_t *cur, const ts_stats_t *prev) {
+
+  unsigned long long *dst;
+  const unsigned long long *a, *b;
+  unsigned int i;
+
+  dst = (unsigned long long *)delta;
+  a = (const unsigned long long *)cur;
+  b = (const unsigned long long *)prev;
+  for ( i = 0; i < TS_STATS_COUNTERS; i++ )
+    dst[i] = a[i] - b[i];
+  delta->connections_active = cur->connections_active;
+}
+
+static unsigned long long ts_stats_requests(const ts_stats_t *stats) {
+
+  unsigned long long requests;
+  unsigned int i;
+
+  requests = 0;
+  for ( i = 0; i < SEND_RESPONSE_TYPES; i++ )
+    requests += stats->responses[i];
+  return requests;
+}
+
+/*
+Share of connections accepted by worker tells whether some workers starve,
+busy time is averaged over given number of workers.
+*/
+static void print_row(const char *label, const ts_stats_t *delta, unsigned long long accepted, unsigned int workers, double seconds) {
+
+  printf("%-8s %6.1f %10.0f %12.0f %10.0f %6.1f %9.0f %9.0f %9.0f %7llu %9.0f %9.0f %9.3f %9.3f %9.3f\n",
+    label,
+    delta->busy_us / (seconds * 1e4 * workers),
+    ts_stats_requests(delta) / seconds,
+    delta->bytes_sent / seconds,
+    delta->connections_accepted / seconds,
+    accepted ? 100.0 * delta->connections_accepted / accepted : 0.0,
+    delta->accept_empty / seconds,
+    delta->connections_shed / seconds,
+    delta->connections_limited / seconds,
+    delta->connections_active,
+    delta->tls_handshakes / seconds,
+    delta->tls_handshake_failures / seconds,
+    ts_histogram_quantile(&delta->request_latency, 0.5) / 1e3,
+    ts_histogram_quantile(&delta->request_latency, 0.99) / 1e3,
+    ts_histogram_quantile(&delta->first_byte_latency, 0.99) / 1e3);
+}
+
+int main(int argc, char **argv) {
+
+  struct ts_stat_options options;
+  struct sigaction sa;
+  struct timespec ts;
+  ts_stats_segment_t *segment;
+  ts_stats_t *prev, *cur, total, prev_total, delta;
+  char label[16];
+  unsigned long long accepted;
+  unsigned int index;
+  int i, iteration;
+
+  options.name = "/" PROGRAM_NAME;
+  options.interval = 1;
+  options.count = 0;
+  options.per_worker = 0;
+
+  for ( i = 1; i < argc; i++ ) {
+    if ( argv[i][0] != '-' ) {
+      usage();
+      return EXIT_FAILURE;
+    }
+    switch ( argv[i][1] ) {
+      case 'w':
+        options.per_worker = 1; continue;
+    }
+    if ( i + 1 >= argc ) {
+      usage();
+      return EXIT_FAILURE;
+    }
+    switch ( argv[i++][1] ) {
+      case 'n':
+        options.name = argv[i]; continue;
+      case 'i':
+        options.interval = atoi(argv[i]); continue;
+      case 'c':
+        options.count = atoi(argv[i]); continue;
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+
+  if ( options.interval < 1 )
+    options.interval = 1;
+
+  segment = ts_stats_segment_open(options.name);
+  if ( segment == NULL ) {
+    fprintf(stderr, "ERROR: Cannot open statistics segment %s.\n", options.name);
+    return EXIT_FAILURE;
+  }
+
+  sa.sa_flags = 0;
+  sa.sa_handler = signal_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  /* Slots are cache line aligned, so must be the copies. */
+  if ( posix_memalign((void **)&prev, TS_CACHE_LINE, segment->workers * sizeof(ts_stats_t)) ||
+       posix_memalign((void **)&cur, TS_CACHE_LINE, segment->workers * sizeof(ts_stats_t)) ) {
+    fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+    return EXIT_FAILURE;
+  }
+
+  /* Reading is only a copy from mapped memory, server is never interrupted. */
+  memset(&prev_total, 0, sizeof(prev_total));
+  for ( index = 0; index < segment->workers; index++ ) {
+    memset(&prev[index], 0, sizeof(ts_stats_t));
+    ts_stats_sum(&prev[index], &segment->slot[index]);
+    ts_stats_sum(&prev_total, &prev[index]);
+  }
+
+  for ( iteration = 0; !terminated && (options.count == 0 || iteration < options.count); iteration++ ) {
+
+    ts.tv_sec = options.interval;
+    ts.tv_nsec = 0;
+    if ( nanosleep(&ts, NULL) < 0 )
+      break;
+
+    memset(&total, 0, sizeof(total));
+    for ( index = 0; index < segment->workers; index++ ) {
+      memset(&cur[index], 0, sizeof(ts_stats_t));
+      ts_stats_sum(&cur[index], &segment->slot[index]);
+      ts_stats_sum(&total, &cur[index]);
+    }
+
+    if ( options.count == 0 )
+      /* Clear screen like top. */
+      printf("\033[H\033[J");
+
+    printf("%s %s, %u workers, rates per second over %d s\n",
+      PROGRAM_NAME, options.name, segment->workers, options.interval);
+    printf("%-8s %6s %10s %12s %10s %6s %9s %9s %9s %7s %9s %9s %9s %9s %9s\n",
+      "worker", "busy%", "req", "bytes", "accepted", "share%", "empty", "shed", "limited", "active", "tls-ok", "tls-fail", "p50-ms", "p99-ms", "ttfb99-ms");
+
+    ts_stats_delta(&delta, &total, &prev_total);
+    accepted = delta.connections_accepted;
+
+    if ( options.per_worker ) {
+      for ( index = 0; index < segment->workers; index++ ) {
+        ts_stats_delta(&delta, &cur[index], &prev[index]);
+        snprintf(label, sizeof(label), "%u", index);
+        print_row(label, &delta, accepted, 1, options.interval);
+      }
+    }
+
+    ts_stats_delta(&delta, &total, &prev_total);
+    print_row("total", &delta, accepted, segment->workers, options.interval);
+    fflush(stdout);
+
+    memcpy(prev, cur, segment->workers * sizeof(ts_stats_t));
+    prev_total = total;
+  }
+
+  free(prev);
+  free(cur);
+
+  return 0;
+}
@@ -1,6 +1,15 @@
 #include "project.h"
 #include "connection.h"
+#include "accesslog.h"
+#include "affinity.h"
+#include "epoch.h"
+#include "handshake.h"
+#include "ratelimit.h"
 #include "ssl.h"
+#include "stats.h"
+#include "teardown.h"
+#include "trace.h"
+#include "utils.h"
 
 #ifdef FORK
 #include "fork.h"
@@ -9,36 +18,276 @@
 #include <arpa/inet.h> /* inet_ntop */
 #include <errno.h>
 #include <fcntl.h> /* F_SETFL, F_GETFL, fcntl() */
+#include <limits.h> /* INT_MAX */
 #include <netdb.h> /* freeaddrinfo */
-#include <netinet/tcp.h> /* SOL_TCP, TCP_NODELAY */
+#include <netinet/in.h> /* IP_TRANSPARENT, IPV6_TRANSPARENT */
+#include <netinet/tcp.h> /* SOL_TCP, TCP_DEFER_ACCEPT, TCP_FASTOPEN, TCP_INFO, TCP_NODELAY */
+#include <poll.h> /* poll() */
+#include <pthread.h> /* pthread_create(), pthread_join(), pthread_sigmask() */
 #include <pwd.h> /* getpwnam() */
-#include <signal.h> /* sigaction(), sigemptyset(), struct sigaction */
+#include <signal.h> /* sigaction(), sigemptyset(), sigsuspend(), struct sigaction */
+#include <stdint.h> /* uint64_t */
 #include <stdio.h>
 #include <stdlib.h> /* EXIT_FAILURE */
 #include <string.h> /* memset() */
+#include <sys/epoll.h> /* epoll_create1(), epoll_ctl(), epoll_wait(), EPOLLEXCLUSIVE */
+#include <sys/eventfd.h> /* eventfd() */
+#include <sys/file.h> /* flock() */
+#include <sys/resource.h> /* getrlimit() */
 #include <syslog.h> /* openlog(), syslog() */
-#include <unistd.h> /* close(), daemon(), fork(), getuid(), setuid(), TEMP_FAILURE_RETRY */
+#include <unistd.h> /* close(), daemon(), execvp(), fork(), getuid(), setuid(), TEMP_FAILURE_RETRY */
 
 volatile int terminated;
 
-static int ts_bind(ts_socket_t *sock) {
+/*
+Incremented by SIGHUP. The first worker which sees a new value drops cached
+files and certificates, the log writer opens its file again.
+*/
+static volatile int reload_requested;
+static int reload_done;
+/* Set by SIGUSR2, the supervisor starts new binary. */
+static volatile int upgrade_requested;
+
+/* Binary and arguments started on upgrade. */
+static char *ts_exec_path;
+static char **ts_exec_argv;
+
+/* Listening sockets passed by the server which started this one on upgrade. */
+static int *ts_inherited_fds;
+static unsigned int ts_inherited_count;
+
+/*
+Take sockets and PID file passed by the server being upgraded. Returns its PID,
+or 0 when this server was not started by upgrade.
+*/
+static pid_t ts_inherit(int *pidfd) {
+
+  char *str, *end;
+  pid_t parent;
+  long fd;
+
+  str = getenv(TS_ENV_PARENT);
+  if ( str == NULL )
+    return 0;
+  parent = atoi(str);
+
+  str = getenv(TS_ENV_PID_FD);
+  if ( str != NULL )
+    *pidfd = atoi(str);
+
+  str = getenv(TS_ENV_LISTEN_FDS);
+  if ( str != NULL && (ts_inherited_fds = malloc((strlen(str) / 2 + 1) * sizeof(int))) != NULL ) {
+    while ( *str ) {
+      fd = strtol(str, &end, 10);
+      if ( end == str || fd < 0 )
+        break;
+      ts_inherited_fds[ts_inherited_count++] = fd;
+      str = ( *end == ',' ) ? end + 1 : end;
+    }
+  }
+
+  unsetenv(TS_ENV_PARENT);
+  unsetenv(TS_ENV_PID_FD);
+  unsetenv(TS_ENV_LISTEN_FDS);
+  return parent;
+}
+
+/* Inherited socket bound to the address of listener, in the order they were passed. */
+static int ts_inherited_socket(ts_socket_t *sock) {
+
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  unsigned int index;
+  int sockfd;
+
+  for ( index = 0; index < ts_inherited_count; index++ ) {
+    sockfd = ts_inherited_fds[index];
+    addrlen = sizeof(addr);
+    if ( sockfd < 0 || getsockname(sockfd, (struct sockaddr *)&addr, &addrlen) < 0 )
+      continue;
+    if ( addrlen == sock->addrlen && !memcmp(&addr, &sock->addr, addrlen) ) {
+      ts_inherited_fds[index] = -1;
+      return sockfd;
+    }
+  }
+
+  return -1;
+}
+
+/* Sockets of listeners the new configuration does not have are closed. */
+static void ts_inherited_close(void) {
+
+  unsigned int index;
+
+  for ( index = 0; index < ts_inherited_count; index++ )
+    if ( ts_inherited_fds[index] >= 0 ) {
+      syslog(LOG_INFO, "Closing inherited socket %d, no listener uses it.", ts_inherited_fds[index]);
+      close(ts_inherited_fds[index]);
+    }
+
+  free(ts_inherited_fds);
+  ts_inherited_fds = NULL;
+  ts_inherited_count = 0;
+}
+
+static void ts_bind_tcp_options(ts_socket_t *sock, int sockfd) {
+
+  int user_timeout;
+
+  /* These options are optimizations only, so failure is not fatal. */
+#ifdef TCP_DEFER_ACCEPT
+  if ( sock->defer_accept > 0 &&
+       setsockopt(sockfd, SOL_TCP, TCP_DEFER_ACCEPT, &sock->defer_accept, sizeof(int)) )
+    syslog(LOG_WARNING, "TCP_DEFER_ACCEPT: %m - %s:%s", sock->ipaddr, sock->port);
+#endif
+#ifdef TCP_FASTOPEN
+  if ( sock->fastopen_qlen > 0 &&
+       setsockopt(sockfd, SOL_TCP, TCP_FASTOPEN, &sock->fastopen_qlen, sizeof(int)) )
+    syslog(LOG_WARNING, "TCP_FASTOPEN: %m - %s:%s", sock->ipaddr, sock->port);
+#endif
+#ifdef TCP_USER_TIMEOUT
+  /* Accepted connections inherit it, data unacknowledged by a dead peer is not kept for minutes. */
+  user_timeout = TS_WRITE_TIMEOUT;
+  if ( setsockopt(sockfd, SOL_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(int)) )
+    syslog(LOG_WARNING, "TCP_USER_TIMEOUT: %m - %s:%s", sock->ipaddr, sock->port);
+#endif
+}
+
+/*
+Listener of prefix is bound to its network address with IP_TRANSPARENT, TPROXY
+hands it connections to any address of the prefix and accepted sockets keep
+the address the client connected to.
+*/
+static int ts_bind_transparent(ts_socket_t *sock, int sockfd) {
+
+  int yes;
+
+  yes = 1;
+#ifdef IPV6_TRANSPARENT
+  if ( sock->addr.ss_family == AF_INET6 )
+    return setsockopt(sockfd, SOL_IPV6, IPV6_TRANSPARENT, &yes, sizeof(int));
+#endif
+  return setsockopt(sockfd, SOL_IP, IP_TRANSPARENT, &yes, sizeof(int));
+}
+
+/* Clear host bits of address, returns -1 when prefix is longer than the address. */
+static int ts_bind_prefix(struct sockaddr_storage *addr, int length) {
+
+  unsigned char *bytes;
+  int size, i;
+
+  if ( addr->ss_family == AF_INET ) {
+    bytes = (unsigned char *)&((struct sockaddr_in *)addr)->sin_addr;
+    size = 4;
+  }
+  else if ( addr->ss_family == AF_INET6 ) {
+    bytes = ((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+    size = 16;
+  }
+  else
+    return -1;
+
+  if ( length > size * 8 )
+    return -1;
+  for ( i = 0; i < size; i++, length -= 8 )
+    if ( length <= 0 )
+      bytes[i] = 0;
+    else if ( length < 8 )
+      bytes[i] &= 0xff << (8 - length);
+
+  return 0;
+}
+
+/* Create listening socket of one worker for listener, returns -1 on failure. */
+static int ts_bind_socket(ts_configuration_t *config, ts_socket_t *sock, int cpu) {
+
+  int sockfd, yes;
+
+  yes = 1;
+  /* Socket of upgraded server keeps its queue, only options are set again. */
+  sockfd = ts_inherited_socket(sock);
+  if ( sockfd < 0 && ( ((sockfd = socket(sock->addr.ss_family, SOCK_STREAM, 0)) < 0) ||
+       (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) ||
+#ifdef SO_REUSEPORT
+       /* Every worker has its own socket, kernel spreads connections among them. */
+       (!config->shared_listen && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int))) ||
+#endif
+       (setsockopt(sockfd, SOL_TCP, TCP_NODELAY, &yes, sizeof(int))) ||
+       (sock->prefix_length && ts_bind_transparent(sock, sockfd)) ||
+       (bind(sockfd, (struct sockaddr *)&sock->addr, sock->addrlen)) ||
+       (listen(sockfd, TS_BACKLOG)) ||
+       (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK)) ) ) {
+    syslog(LOG_ERR, "Cannot listen: %m - %s:%s", sock->ipaddr, sock->port);
+    if ( sockfd >= 0 )
+      close(sockfd);
+    return -1;
+  }
+
+  ts_bind_tcp_options(sock, sockfd);
+
+#ifdef SO_INCOMING_CPU
+  /* Kernel prefers the socket whose CPU processed the packets of connection. */
+  if ( config->incoming_cpu && !config->shared_listen && cpu >= 0 &&
+       setsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(int)) )
+    syslog(LOG_WARNING, "SO_INCOMING_CPU: %m - %s:%s", sock->ipaddr, sock->port);
+#else
+  (void)cpu;
+#endif
+
+  return sockfd;
+}
+
+/*
+Program of reuseport group of listener hands connections to sockets of the
+first count workers, those running. Socket of a retired worker then gets no
+new connections while it serves those queued. Program applies to the whole
+group, fixed pool keeps hashing by the kernel unless steered by CPU.
+*/
+static void ts_bind_steer(ts_configuration_t *config, ts_socket_t *sock, ts_worker_t *workers, unsigned int count) {
+
+  if ( config->shared_listen )
+    return;
+  if ( config->steer_cpu )
+    ts_affinity_steer(sock->sockfds[0], workers, count);
+  else if ( config->max_workers > config->workers )
+    ts_affinity_spread(sock->sockfds[0], count);
+}
+
+/*
+Listening sockets are created by the supervisor, one per worker for each
+listener and in worker order. Their order in the reuseport group is then
+stable, even when a worker is restarted, which CPU steering relies on. With
+shared listen sockets there is one socket per listener used by all workers.
+Sockets of workers the pool may grow to are created when they are started.
+Sockets inherited on upgrade are taken in the same order.
+*/
+static int ts_bind(ts_configuration_t *config, ts_worker_t *workers) {
 
   struct addrinfo hints, *servinfo;
   struct sockaddr_in *ipv4;
   ts_socket_t *cur_sock;
-  int rv, sockfd, yes;
+  unsigned int index, count;
+  int rv;
 
   memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_INET;
   hints.ai_socktype = SOCK_STREAM;
 
+  if ( config->shared_listen && (config->incoming_cpu || config->steer_cpu) )
+    syslog(LOG_WARNING, "Workers share listen sockets, steering by CPU is disabled.");
+  count = config->shared_listen ? 1 : config->workers;
+
   /* Create sockets. */
-  yes = 1;
-  for ( cur_sock = sock; cur_sock; cur_sock = cur_sock->next ) {
+  for ( cur_sock = config->sock; cur_sock; cur_sock = cur_sock->next ) {
 
+    /* Listener without address takes IPv4 wildcard, given addresses are of either family. */
     if ( cur_sock->ipaddr == NULL ) {
+      hints.ai_family = AF_INET;
       hints.ai_flags = AI_PASSIVE;
     }
+    else {
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_flags = cur_sock->prefix_length ? AI_NUMERICHOST : 0;
+    }
 
     rv = getaddrinfo(cur_sock->ipaddr, cur_sock->port, &hints, &servinfo);
     if ( rv != 0 ) {
@@ -52,132 +301,772 @@ static int ts_bind(ts_socket_t *sock) {
       inet_ntop(servinfo->ai_family, &(ipv4->sin_addr), cur_sock->ipaddr, INET6_ADDRSTRLEN);
     }
 
-    if ( ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) < 1) ||
-         (setsockopt(sockfd, SOL_SOCKET, TS_SOL_SOCKET, &yes, sizeof(int))) ||
-         (setsockopt(sockfd, SOL_TCP, TCP_NODELAY, &yes, sizeof(int))) ||
-         (bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen)) ||
-         (listen(sockfd, TS_BACKLOG)) ||
-         (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK)) ) {
+    memcpy(&cur_sock->addr, servinfo->ai_addr, servinfo->ai_addrlen);
+    cur_sock->addrlen = servinfo->ai_addrlen;
+    freeaddrinfo(servinfo);
+
+    if ( cur_sock->prefix_length && ts_bind_prefix(&cur_sock->addr, cur_sock->prefix_length) < 0 ) {
+      syslog(LOG_ERR, "Invalid prefix length %d - %s:%s", cur_sock->prefix_length, cur_sock->ipaddr, cur_sock->port);
+      return -1;
+    }
+
+    cur_sock->sockfds = malloc(config->max_workers * sizeof(int));
+    if ( cur_sock->sockfds == NULL ) {
       syslog(LOG_ERR, "Abort: %m - %s:%s", cur_sock->ipaddr, cur_sock->port);
-      exit(EXIT_FAILURE);
+      return -1;
     }
+    for ( index = 0; index < config->max_workers; index++ )
+      cur_sock->sockfds[index] = -1;
 
-    cur_sock->sockfd = sockfd;
+    for ( index = 0; index < count; index++ ) {
+      cur_sock->sockfds[index] = ts_bind_socket(config, cur_sock, workers[index].cpu);
+      if ( cur_sock->sockfds[index] < 0 )
+        return -1;
+    }
+    if ( config->shared_listen )
+      for ( ; index < config->max_workers; index++ )
+        cur_sock->sockfds[index] = cur_sock->sockfds[0];
 
-    freeaddrinfo(servinfo);
+    ts_bind_steer(config, cur_sock, workers, count);
 
-    syslog(LOG_INFO, "Listening on address %s and port %s with options: %d.", cur_sock->ipaddr, cur_sock->port, cur_sock->options);
+    if ( cur_sock->prefix_length )
+      syslog(LOG_INFO, "Listening on prefix %s/%d and port %s with options: %d.", cur_sock->ipaddr, cur_sock->prefix_length, cur_sock->port, cur_sock->options);
+    else
+      syslog(LOG_INFO, "Listening on address %s and port %s with options: %d.", cur_sock->ipaddr, cur_sock->port, cur_sock->options);
   }
 
+  ts_inherited_close();
   return 0;
 }
 
-static int ts_listen(ts_socket_t *sock) {
+#ifdef FORK
+/* Create missing sockets of worker added to the pool. */
+static int ts_bind_worker(ts_configuration_t *config, ts_worker_t *worker) {
 
-  int nfds;
-  int sockfd;
-  int select_rv;
   ts_socket_t *cur_sock;
-  fd_set readfds, selectfds;
+
+  for ( cur_sock = config->sock; cur_sock; cur_sock = cur_sock->next ) {
+    if ( cur_sock->sockfds[worker->index] >= 0 )
+      continue;
+    cur_sock->sockfds[worker->index] = ts_bind_socket(config, cur_sock, worker->cpu);
+    if ( cur_sock->sockfds[worker->index] < 0 )
+      return -1;
+  }
+
+  return 0;
+}
+
+/*
+Close sockets of worker removed from the pool. Retired worker keeps its copy
+until it has served its queue.
+*/
+static void ts_unbind_worker(ts_configuration_t *config, unsigned int index) {
+
+  ts_socket_t *cur_sock;
+
+  if ( config->shared_listen )
+    return;
+
+  for ( cur_sock = config->sock; cur_sock; cur_sock = cur_sock->next )
+    if ( cur_sock->sockfds[index] >= 0 ) {
+      close(cur_sock->sockfds[index]);
+      cur_sock->sockfds[index] = -1;
+    }
+}
+#endif
+
+/* First worker which sees a new reload request drops cached files and certificates. */
+static void ts_reload_if_requested(void) {
+
+  int done, requested;
+
+  done = __atomic_load_n(&reload_done, __ATOMIC_RELAXED);
+  requested = reload_requested;
+  if ( done == requested ||
+       !__atomic_compare_exchange_n(&reload_done, &done, requested, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+    return;
+
+  connection_files_clear();
+#ifdef USE_SSL
+  ts_ssl_certs_clear();
+#endif
+  syslog(LOG_INFO, "Cached files and certificates were dropped.");
+}
+
+/* Connections waiting in accept queue of listening socket, 0 when unknown. */
+static unsigned int ts_listen_queued(int sockfd) {
+
+  struct tcp_info info;
+  socklen_t length;
+
+  length = sizeof(info);
+  if ( getsockopt(sockfd, SOL_TCP, TCP_INFO, &info, &length) < 0 || info.tcpi_state != TCP_LISTEN )
+    return 0;
+  /* Listening socket reports its accept queue as unacknowledged segments. */
+  return info.tcpi_unacked;
+}
+
+/*
+Connections of listener in flight in this worker, those in accept queue and TLS
+handshakes waiting in its event loop.
+*/
+static unsigned int ts_listen_inflight(const ts_socket_t *sock, int sockfd) {
+
+#ifdef USE_SSL
+  return ts_listen_queued(sockfd) + ts_handshake_pending(sock);
+#else
+  (void)sock;
+  return ts_listen_queued(sockfd);
+#endif
+}
+
+/*
+Every socket of a reuseport group of workers running gets its share of
+connections, and of the cap. Shares add up to the cap, the lowest indexes take
+the remainder. Share of 0 sheds every connection.
+*/
+static unsigned int ts_inflight_limit(ts_configuration_t *config, unsigned int max, unsigned int index, unsigned int active) {
+
+  if ( config->shared_listen )
+    return max;
+  return max / active + ( index < max % active );
+}
+
+/*
+Close connections past their deadlines in the event loop of worker. Returns
+milliseconds until the next deadline, -1 when nothing waits.
+*/
+static int ts_listen_expire(void) {
+
+  int timeout, next;
+
+  timeout = ts_teardown_expire();
+  next = connection_writes_expire();
+  if ( next >= 0 && (timeout < 0 || next < timeout) )
+    timeout = next;
+#ifdef USE_SSL
+  next = ts_handshake_expire();
+  if ( next >= 0 && (timeout < 0 || next < timeout) )
+    timeout = next;
+#endif
+  return timeout;
+}
+
+/* Accepted connection is limited, waits for its handshake in the event loop, or is served. */
+static void ts_listen_serve(ts_socket_t *sock, int sockfd, struct sockaddr_storage *addr) {
+
+  /* Management listener stays reachable for clients being limited. */
+  if ( !(sock->options & DO_ADMIN) && !ts_ratelimit_allow(addr) ) {
+    connection_shed(sock, sockfd, 429);
+    return;
+  }
+
+#ifdef USE_SSL
+  /* Handshake waits for client in the event loop, worker goes on with other connections. */
+  if ( (sock->options & (DO_SSL | DO_DETECT)) && ts_handshake_start(sock, sockfd, addr) == 0 )
+    return;
+#endif
+
+  DEBUG_PRINT("Starting handling socket %d", sockfd);
+  connection_new(sock, sockfd, addr);
+}
+
+/*
+Wait for connections on own sockets of all listeners. Sockets shared by workers are
+registered with EPOLLEXCLUSIVE, so a new connection wakes only one of them.
+Events are level triggered, a worker takes one connection per listener and
+serves it before it waits again, leaving the rest of the queue to the others.
+Connections waiting over the caps are shed, oldest first, so that those left
+wait less. TLS handshakes are registered here too and advanced whenever their
+socket is ready, the connection is served once its request was read. Served
+connections wait here for client to close with -T wait. Worker threads are
+woken up for termination by wakefd.
+*/
+static int ts_listen(ts_configuration_t *config, unsigned int index) {
+
+  int epfd, sockfd, listenfd, i, nevents, paused, fd_high, timeout;
+  unsigned int queued, limit, global_limit, waiting, excess, active, shares;
+  long long busy;
+  ts_socket_t *cur_sock;
+  struct epoll_event event, events[TS_LISTEN_EVENTS];
   struct sockaddr_storage their_addr;
+  struct pollfd pfd;
+  struct rlimit rl;
   socklen_t sin_size;
 
-  nfds = 0;
-  FD_ZERO(&readfds);
-  for ( cur_sock = sock; cur_sock; cur_sock = cur_sock->next ) {
-    FD_SET(cur_sock->sockfd, &readfds);
-    if ( cur_sock->sockfd > nfds )
-      nfds = cur_sock->sockfd;
+  /* Accepting stops short of the descriptor limit, served files and certificates need some too. */
+  fd_high = INT_MAX;
+  if ( getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < INT_MAX )
+    fd_high = rl.rlim_cur * TS_FD_HIGH_PERCENT / 100;
+  active = ts_stats_active(config->workers);
+  global_limit = ts_inflight_limit(config, config->max_inflight, index, active);
+  paused = 0;
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if ( epfd < 0 ) {
+    syslog(LOG_ERR, "Child epoll_create1() returned error: %m.");
+    exit(EXIT_FAILURE);
   }
 
-  nfds++;
+  for ( cur_sock = config->sock; cur_sock; cur_sock = cur_sock->next ) {
+    event.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    if ( config->shared_listen )
+      event.events |= EPOLLEXCLUSIVE;
+#endif
+    event.data.ptr = cur_sock;
+    if ( epoll_ctl(epfd, EPOLL_CTL_ADD, cur_sock->sockfds[index], &event) < 0 ) {
+      syslog(LOG_ERR, "Child epoll_ctl() returned error: %m.");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if ( config->wakefd >= 0 ) {
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if ( epoll_ctl(epfd, EPOLL_CTL_ADD, config->wakefd, &event) < 0 ) {
+      syslog(LOG_ERR, "Child epoll_ctl() returned error: %m.");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+#ifdef USE_SSL
+  for ( cur_sock = config->sock; cur_sock; cur_sock = cur_sock->next )
+    if ( cur_sock->options & (DO_SSL | DO_DETECT) ) {
+      ts_handshake_init(epfd, config->sock->index + 1);
+      break;
+    }
+#endif
+  /* Every listener may linger after request bodies and write responses in the event loop. */
+  ts_teardown_init(epfd);
+  connection_writes_init(epfd);
 
-  select_rv = 0;
   while ( !terminated ) {
 
-    /* Call select() only if we have something more to process. */
-    if ( select_rv <= 0 ) {
+    DEBUG_PRINT("Waiting for epoll.");
+
+    /* Idle worker wakes up to show supervisor it is alive, and to close connections past deadline. */
+    timeout = ts_listen_expire();
+    if ( timeout < 0 || timeout > TS_HEARTBEAT_INTERVAL )
+      timeout = TS_HEARTBEAT_INTERVAL;
+    nevents = epoll_wait(epfd, events, TS_LISTEN_EVENTS, timeout);
+    TS_HEARTBEAT();
+    ts_reload_if_requested();
+    if ( nevents < 0 ) {
+      if ( errno == EINTR ) {
+        /* Signal was handled, see if something was requested. */
+        TRACE_DUMP_IF_REQUESTED();
+        continue;
+      }
+      if ( !terminated ) {
+        syslog(LOG_ERR, "Child epoll_wait() returned error: %m.");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    if ( nevents == 0 ) {
+      TRACE_DUMP_IF_REQUESTED();
+      continue;
+    }
+    TS_STATS_INC(accept_wakeups);
+
+    /* Pool was resized, connections of a client are spread over a different number of workers. */
+    shares = ts_stats_active(config->workers);
+    if ( shares != active ) {
+      active = shares;
+      global_limit = ts_inflight_limit(config, config->max_inflight, index, active);
+      if ( config->client_rate )
+        ts_ratelimit_share(config->client_rate / active, config->client_burst / active);
+    }
+
+    busy = ts_clock_ns();
+
+    waiting = 0;
+    if ( config->max_inflight )
+      for ( cur_sock = config->sock; cur_sock; cur_sock = cur_sock->next )
+        waiting += ts_listen_inflight(cur_sock, cur_sock->sockfds[index]);
 
-      DEBUG_PRINT("Waiting for select.");
+    for ( i = 0; i < nevents && !terminated; i++ ) {
 
-      selectfds = readfds;
-      select_rv = select(nfds, &selectfds, NULL, NULL, NULL);
+      cur_sock = (ts_socket_t *)events[i].data.ptr;
+      if ( cur_sock == NULL )
+        continue;
+      if ( ts_teardown_owns(cur_sock) ) {
+        ts_teardown_event(cur_sock);
+        continue;
+      }
+      if ( connection_writes_owns(cur_sock) ) {
+        connection_writes_event(cur_sock);
+        continue;
+      }
+#ifdef USE_SSL
+      if ( ts_handshake_owns(cur_sock) ) {
+        ts_handshake_event(cur_sock);
+        continue;
+      }
+#endif
+      listenfd = cur_sock->sockfds[index];
+
+      excess = 0;
+      if ( cur_sock->max_inflight || config->max_inflight ) {
+        queued = ts_listen_inflight(cur_sock, listenfd);
+        limit = ts_inflight_limit(config, cur_sock->max_inflight, index, active);
+        if ( cur_sock->max_inflight && queued > limit )
+          excess = queued - limit;
+        if ( config->max_inflight && waiting > global_limit && waiting - global_limit > excess )
+          excess = ( waiting - global_limit < queued ) ? waiting - global_limit : queued;
+      }
+      for ( ; excess > 0; excess-- ) {
+        sockfd = accept(listenfd, NULL, NULL);
+        if ( sockfd < 0 )
+          break;
+        connection_shed(cur_sock, sockfd, 503);
+        if ( waiting > 0 )
+          waiting--;
+      }
 
-      if ( select_rv < 0 ) {
-        if ( !terminated ) {
-          syslog(LOG_ERR, "Child select() returned error: %m.");
-          exit(EXIT_FAILURE);
+      sin_size = sizeof(struct sockaddr_storage);
+      TRACE_BEGIN(trace_accept);
+      sockfd = accept(listenfd, (struct sockaddr *)&their_addr, &sin_size);
+      TRACE_END(TRACE_ACCEPT, trace_accept);
+      if ( sockfd < 0 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+          /* Another worker took the connection, or client closed it before we got a chance to accept it. */
+          DEBUG_PRINT("Child accept(): %d", errno);
+          TS_STATS_INC(accept_empty);
         }
+        else {
+          syslog(LOG_WARNING, "Child accept() returned error: %m.");
+          if ( errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM )
+            paused = 1;
+        }
+        continue;
       }
-      else if ( select_rv == 0 ) {
-        /* Since we did not specify timeout, this should never happen. */
-        syslog(LOG_WARNING, "Child select() returned zero.");
+      if ( waiting > 0 )
+        waiting--;
+
+      if ( sockfd >= fd_high ) {
+        connection_shed(cur_sock, sockfd, 503);
+        paused = 1;
         continue;
       }
 
+      ts_listen_serve(cur_sock, sockfd, &their_addr);
     }
+    TS_STATS_ADD(busy_us, (ts_clock_ns() - busy) / 1000);
 
-    sockfd = 0;
-    for ( cur_sock = sock; cur_sock; cur_sock = cur_sock->next ) {
-      if ( FD_ISSET(cur_sock->sockfd, &selectfds) ) {
-        sockfd = cur_sock->sockfd;
-        select_rv--;
-        break;
-      }
+    if ( paused ) {
+      /* Connections wait in the queue meanwhile, kernel drops new ones when it is full. */
+      TS_STATS_INC(accept_pauses);
+      pfd.fd = config->wakefd;
+      pfd.events = POLLIN;
+      poll(&pfd, config->wakefd >= 0, TS_ACCEPT_PAUSE);
+      paused = 0;
     }
 
-    /* At this point select() should return socket handler, ie. cur_fd != 0. */
-    if ( !sockfd ) {
-      /* This is bad case since select() will never be called again. */
-      syslog(LOG_WARNING, "Child select() returned a value of %d, but no file descriptors of interest are ready for read.", select_rv);
-      /* Set select_rv = 0 so that select() will be called on the next loop iteration. */
-      select_rv = 0;
-      continue;
+    TRACE_DUMP_IF_REQUESTED();
+  }
+
+  /*
+  Connections queued on own sockets would be reset once they are closed, they
+  are served first. Supervisor steered new ones to other workers, those that
+  come meanwhile are left to the socket's next owner.
+  */
+  for ( cur_sock = config->sock; cur_sock && !config->shared_listen; cur_sock = cur_sock->next ) {
+    listenfd = cur_sock->sockfds[index];
+    for ( queued = ts_listen_queued(listenfd); queued > 0; queued-- ) {
+      sin_size = sizeof(struct sockaddr_storage);
+      sockfd = accept(listenfd, (struct sockaddr *)&their_addr, &sin_size);
+      if ( sockfd < 0 )
+        break;
+      ts_listen_serve(cur_sock, sockfd, &their_addr);
     }
+  }
 
-    sin_size = sizeof(struct sockaddr_storage);
-    sockfd = accept(cur_sock->sockfd, (struct sockaddr *)&their_addr, &sin_size);
-    if ( sockfd < 0 ) {
-      if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
-        /* Client closed connection before we got a chance to accept it. */
-        DEBUG_PRINT("Child accept(): %d", errno);
+  /* Handshakes, writes and teardowns already started are finished, new connections are left to other workers. */
+  for ( cur_sock = config->sock; cur_sock; cur_sock = cur_sock->next )
+    epoll_ctl(epfd, EPOLL_CTL_DEL, cur_sock->sockfds[index], NULL);
+  if ( config->wakefd >= 0 )
+    epoll_ctl(epfd, EPOLL_CTL_DEL, config->wakefd, NULL);
+  while ( (timeout = ts_listen_expire()) >= 0 ) {
+    nevents = epoll_wait(epfd, events, TS_LISTEN_EVENTS, timeout);
+    for ( i = 0; i < nevents; i++ ) {
+      if ( ts_teardown_owns(events[i].data.ptr) ) {
+        ts_teardown_event(events[i].data.ptr);
+        continue;
       }
-      else {
-        syslog(LOG_WARNING, "Child accept() returned error: %m.");
+      if ( connection_writes_owns(events[i].data.ptr) ) {
+        connection_writes_event(events[i].data.ptr);
+        continue;
       }
-      continue;
+#ifdef USE_SSL
+      ts_handshake_event(events[i].data.ptr);
+#endif
     }
-
-    DEBUG_PRINT("Starting handling socket %d", sockfd);
-    connection_new(cur_sock, sockfd);
   }
 
+  close(epfd);
   return 0;
 }
 
 int ts_main_loop(void *arg) {
 
+  ts_worker_t *worker;
   ts_configuration_t *config;
+  ts_socket_t *cur_sock;
+  unsigned int index, active;
 
-  config = (ts_configuration_t *)arg;
+  worker = (ts_worker_t *)arg;
+  config = worker->config;
 
-  if ( ts_bind(config->sock) < 0 ) {
-    syslog(LOG_CRIT, "Cannot bind to ports!");
-    return 1;
-  }
+  /*
+  Pin before the worker allocates its own memory, sketch, arenas and slots are
+  first touched here and come from the local node. Statistics and log slots in
+  shared memory were cleared by supervisor and stay on its node.
+  */
+  if ( worker->cpu >= 0 )
+    ts_affinity_set(worker->cpu);
+
+  ts_stats_attach(worker->index);
+  ts_log_attach(worker->index);
+  ts_epoch_register();
+
+  /* Connections of a client are spread over workers running, so is its rate. */
+  active = ts_stats_active(config->workers);
+  if ( config->client_rate )
+    ts_ratelimit_init(config->client_rate / active, config->client_burst / active, config->client_memory);
+
+  /* Restarted worker starts with empty caches. */
+  if ( !config->threads )
+    reload_done = reload_requested;
+
+#ifdef TRACE
+  /* SIGUSR1 dumps latency of request phases to syslog. */
+  trace_setup_signal_handler();
+#endif
+
+  /* Keep own socket of every listener, the others belong to other worker processes. */
+  if ( !config->threads )
+    for ( cur_sock = config->sock; cur_sock; cur_sock = cur_sock->next )
+      for ( index = 0; index < config->max_workers; index++ )
+        if ( cur_sock->sockfds[index] >= 0 && cur_sock->sockfds[index] != cur_sock->sockfds[worker->index] )
+          close(cur_sock->sockfds[index]);
 
 #ifdef USE_SSL
   /* SSL */
-  SSL_library_init();
+  if ( ts_ssl_init() < 0 )
+    syslog(LOG_WARNING, "Cannot create TLS context.");
 #endif /* USE_SSL */
 
-  /* Change user. */
+  /* Change user, worker threads run with user set by main thread. */
+  if ( !config->threads && config->pw != NULL && setuid(config->pw->pw_uid) ) {
+    syslog(LOG_WARNING, "setuid %d: %m", config->pw->pw_uid);
+    return 1;
+  }
+
+  ts_listen(config, worker->index);
+
+  return 0;
+}
+
+#ifdef FORK
+int ts_log_writer_loop(void *arg) {
+
+  ts_configuration_t *config;
+
+  config = (ts_configuration_t *)arg;
+
+  /* Log file is opened with privileges of workers. */
   if ( config->pw != NULL && setuid(config->pw->pw_uid) ) {
     syslog(LOG_WARNING, "setuid %d: %m", config->pw->pw_uid);
     return 1;
   }
 
-  ts_listen(config->sock);
+  return ts_log_writer_run(config->access_log, config->log_rotate_size, &terminated, &reload_requested);
+}
+#endif
+
+/*
+Start new binary with the same arguments. It inherits listening sockets and
+the PID file, and terminates this server once its sockets are taken, so that
+workers of this server finish their connections while new workers take the
+next ones.
+*/
+static void ts_upgrade(ts_configuration_t *config, int pidfd) {
+
+  char fds[CHAR_BUF_SIZE], number[16];
+  ts_socket_t *cur_sock;
+  unsigned int index;
+  size_t length;
+  sigset_t mask;
+  pid_t pid;
+
+  pid = fork();
+  if ( pid < 0 ) {
+    syslog(LOG_ERR, "Cannot start upgrade: %m.");
+    return;
+  }
+  if ( pid > 0 ) {
+    syslog(LOG_INFO, "Upgrading to %s with PID %ld.", ts_exec_path, (long)pid);
+    return;
+  }
+
+  /* Sockets are passed in listener and worker order, shared socket only once. */
+  length = 0;
+  fds[0] = 0;
+  for ( cur_sock = config->sock; cur_sock; cur_sock = cur_sock->next )
+    for ( index = 0; index < config->max_workers && length < sizeof(fds); index++ )
+      if ( cur_sock->sockfds[index] >= 0 && (index == 0 || cur_sock->sockfds[index] != cur_sock->sockfds[0]) )
+        length += snprintf(fds + length, sizeof(fds) - length, "%s%d", length ? "," : "", cur_sock->sockfds[index]);
+
+  setenv(TS_ENV_LISTEN_FDS, fds, 1);
+  if ( pidfd > 0 ) {
+    snprintf(number, sizeof(number), "%d", pidfd);
+    setenv(TS_ENV_PID_FD, number, 1);
+  }
+  snprintf(number, sizeof(number), "%ld", (long)getppid());
+  setenv(TS_ENV_PARENT, number, 1);
+
+  sigemptyset(&mask);
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+  execvp(ts_exec_path, ts_exec_argv);
+
+  syslog(LOG_ERR, "Cannot execute %s: %m.", ts_exec_path);
+  _exit(127);
+}
+
+#ifdef FORK
+/* Fork supervisor state kept between ticks. */
+struct ts_supervisor {
+  ts_configuration_t *config;
+  ts_worker_t *workers;
+  struct fork_process_s *process[TS_MAX_WORKERS];
+  /* Workers 0 to active - 1 are running. */
+  unsigned int active;
+  /* Busy time of every worker at the previous tick. */
+  unsigned long long busy[TS_MAX_WORKERS];
+  long long last_tick;
+  /* Utilization summed over ticks of the current window. */
+  double utilization;
+  unsigned int ticks;
+  /* Reload request already forwarded to workers. */
+  int reloaded;
+  int pidfd;
+};
+
+static int ts_supervisor_start(struct ts_supervisor *supervisor) {
+
+  ts_socket_t *cur_sock;
+  unsigned int index;
+
+  /* Reuseport group keeps worker order only once socket of the last retired worker is closed. */
+  index = supervisor->active;
+  if ( subprocess_retiring() > 0 ) {
+    syslog(LOG_INFO, "Worker %u is still retiring, not starting it again yet.", index);
+    return -1;
+  }
+  if ( ts_bind_worker(supervisor->config, &supervisor->workers[index]) < 0 ) {
+    ts_unbind_worker(supervisor->config, index);
+    return -1;
+  }
+
+  /* Workers split rates and caps by the count, new one reads it when it starts. */
+  ts_stats_publish_active(index + 1);
+  supervisor->process[index] = subprocess_add(&ts_main_loop, (void *)&supervisor->workers[index]);
+  if ( supervisor->process[index] == NULL ) {
+    ts_stats_publish_active(index);
+    ts_unbind_worker(supervisor->config, index);
+    return -1;
+  }
+
+  for ( cur_sock = supervisor->config->sock; cur_sock; cur_sock = cur_sock->next )
+    ts_bind_steer(supervisor->config, cur_sock, supervisor->workers, index + 1);
+
+  supervisor->busy[index] = ts_stats_segment ? __atomic_load_n(&ts_stats_segment->slot[index].busy_us, __ATOMIC_RELAXED) : 0;
+  supervisor->active++;
+  return 0;
+}
+
+/*
+Worker with the highest index is retired, so reuseport group keeps its order.
+New connections are steered away from its socket first, it serves those
+already queued before it exits.
+*/
+static void ts_supervisor_stop(struct ts_supervisor *supervisor) {
+
+  ts_socket_t *cur_sock;
+  unsigned int index;
+
+  index = --supervisor->active;
+  ts_stats_publish_active(index);
+  for ( cur_sock = supervisor->config->sock; cur_sock; cur_sock = cur_sock->next )
+    ts_bind_steer(supervisor->config, cur_sock, supervisor->workers, index);
+  subprocess_retire(supervisor->process[index]);
+  supervisor->process[index] = NULL;
+  ts_unbind_worker(supervisor->config, index);
+}
+
+/*
+Forward reload to workers and start upgrade when requested. Replace workers
+which missed their heartbeat, and resize the pool within -w and -W by average
+utilization of workers over a window of ticks.
+*/
+static int ts_supervisor_tick(void *arg) {
+
+  struct ts_supervisor *supervisor;
+  ts_configuration_t *config;
+  struct fork_process_s *process;
+  unsigned long long busy, busy_sum, heartbeat;
+  long long now, elapsed;
+  double utilization;
+  unsigned int index;
+
+  supervisor = (struct ts_supervisor *)arg;
+  config = supervisor->config;
+
+  if ( supervisor->reloaded != reload_requested ) {
+    supervisor->reloaded = reload_requested;
+    syslog(LOG_INFO, "Reloading workers and log writer.");
+    subprocess_signal(SIGHUP);
+  }
+
+  if ( upgrade_requested ) {
+    upgrade_requested = 0;
+    ts_upgrade(config, supervisor->pidfd);
+  }
+
+  /* Tick after a signal comes early, workers are checked at regular intervals only. */
+  now = ts_clock_ms();
+  if ( ts_stats_segment == NULL || now - supervisor->last_tick < TS_SUPERVISOR_TICK / 2 )
+    return 0;
+
+  elapsed = now - supervisor->last_tick;
+  supervisor->last_tick = now;
+
+  busy_sum = 0;
+  for ( index = 0; index < supervisor->active; index++ ) {
+
+    busy = __atomic_load_n(&ts_stats_segment->slot[index].busy_us, __ATOMIC_RELAXED);
+    busy_sum += busy - supervisor->busy[index];
+    supervisor->busy[index] = busy;
+
+    /* Worker blocked in a single connection, in SSL_accept() for example, stops beating. */
+    process = supervisor->process[index];
+    heartbeat = __atomic_load_n(&ts_stats_segment->slot[index].heartbeat, __ATOMIC_RELAXED);
+    if ( config->stall_timeout > 0 && process->pid > 0 &&
+         now - process->started > config->stall_timeout && now - (long long)heartbeat > config->stall_timeout ) {
+      syslog(LOG_WARNING, "Worker %u with PID %d missed heartbeat for %lld ms, replacing it.", index, process->pid, now - (long long)heartbeat);
+      kill(process->pid, SIGKILL);
+    }
+  }
+
+  if ( config->max_workers == config->workers || elapsed <= 0 )
+    return 0;
+
+  supervisor->utilization += busy_sum / (elapsed * 1000.0 * supervisor->active);
+  if ( ++supervisor->ticks < TS_SCALE_WINDOW )
+    return 0;
+
+  utilization = supervisor->utilization / supervisor->ticks;
+  supervisor->utilization = 0;
+  supervisor->ticks = 0;
+
+  if ( utilization > TS_SCALE_UP && supervisor->active < config->max_workers ) {
+    syslog(LOG_INFO, "Workers are %.0f%% busy, starting worker %u.", utilization * 100, supervisor->active);
+    ts_supervisor_start(supervisor);
+  }
+  else if ( utilization < TS_SCALE_DOWN && supervisor->active > config->workers ) {
+    syslog(LOG_INFO, "Workers are %.0f%% busy, retiring worker %u.", utilization * 100, supervisor->active - 1);
+    ts_supervisor_stop(supervisor);
+  }
+
+  return 0;
+}
+#endif
+
+static void *ts_worker_thread(void *arg) {
+
+  ts_main_loop(arg);
+  return NULL;
+}
+
+static void *ts_log_writer_thread(void *arg) {
+
+  ts_configuration_t *config;
+
+  config = (ts_configuration_t *)arg;
+  ts_log_writer_run(config->access_log, config->log_rotate_size, &terminated, &reload_requested);
+  return NULL;
+}
+
+/*
+Run workers as threads of this process, they share caches of files and
+certificates. Signals are taken by the main thread only, which wakes up the
+workers through eventfd on termination and waits for them.
+*/
+static int ts_threads_run(ts_configuration_t *config, ts_worker_t *workers, int pidfd) {
+
+  pthread_t *threads, writer;
+  sigset_t mask, oldmask;
+  unsigned int index, started;
+  int rv, writer_started;
+  uint64_t one;
+
+  threads = malloc(config->workers * sizeof(pthread_t));
+  config->wakefd = eventfd(0, EFD_CLOEXEC);
+  if ( threads == NULL || config->wakefd < 0 ) {
+    syslog(LOG_ERR, "Cannot start worker threads: %m.");
+    free(threads);
+    return -1;
+  }
+
+  /* User is changed once for the whole process, log file is opened with its privileges. */
+  if ( config->pw != NULL && setuid(config->pw->pw_uid) ) {
+    syslog(LOG_WARNING, "setuid %d: %m", config->pw->pw_uid);
+    free(threads);
+    return -1;
+  }
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+
+  writer_started = config->access_log && ts_log_init(config->workers, config->log_sample) == 0 &&
+                   pthread_create(&writer, NULL, ts_log_writer_thread, (void *)config) == 0;
+
+  for ( started = 0; started < config->workers; started++ ) {
+    rv = pthread_create(&threads[started], NULL, ts_worker_thread, (void *)&workers[started]);
+    if ( rv != 0 ) {
+      errno = rv;
+      syslog(LOG_ERR, "Cannot start worker thread: %m.");
+      terminated = 1;
+      break;
+    }
+  }
+
+  while ( !terminated ) {
+    sigsuspend(&oldmask);
+    if ( upgrade_requested && !terminated ) {
+      upgrade_requested = 0;
+      ts_upgrade(config, pidfd);
+    }
+  }
+
+  one = 1;
+  if ( write(config->wakefd, &one, sizeof(one)) < 0 )
+    syslog(LOG_WARNING, "Cannot wake up worker threads: %m.");
+  for ( index = 0; index < started; index++ )
+    pthread_join(threads[index], NULL);
+  if ( writer_started )
+    pthread_join(writer, NULL);
+
+  pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+  close(config->wakefd);
+  config->wakefd = -1;
+  free(threads);
 
   return 0;
 }
@@ -194,16 +1083,39 @@ static void signal_handler(int signum) {
     else if ( signum == SIGINT )
       signal(SIGINT, SIG_IGN);
   }
+  else if ( signum == SIGHUP )
+    reload_requested++;
+  else if ( signum == SIGUSR2 )
+    upgrade_requested = 1;
 
 }
 
+/* PID file is left to upgraded server which wrote its own PID there. */
+static int ts_pidfile_owned(int pidfd) {
+
+  char pid[11];
+  ssize_t length;
+
+  length = pread(pidfd, pid, sizeof(pid) - 1, 0);
+  if ( length <= 0 )
+    return 0;
+  pid[length] = 0;
+  return atoi(pid) == getpid();
+}
+
 int main(int argc, char **argv) {
 
   int pidfd;
+  unsigned int index;
   char pid[11];
   uid_t uid;
+  pid_t parent;
   struct sigaction sa;
   ts_configuration_t *config;
+  ts_worker_t *workers;
+#ifdef FORK
+  struct ts_supervisor supervisor;
+#endif
 
   /* Setup signal handler. */
   sa.sa_flags = 0;
@@ -214,6 +1126,18 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+  /* SIGHUP reloads and SIGUSR2 upgrades, requests in progress are not interrupted. */
+  sa.sa_flags = SA_RESTART;
+  if ( sigaction(SIGHUP, &sa, NULL) < 0 || sigaction(SIGUSR2, &sa, NULL) < 0 ) {
+    fprintf(stderr, "ERROR: Signal handler could not be set!\n");
+    exit(EXIT_FAILURE);
+  }
+
+#ifdef TRACE
+  /* Only workers dump traces, so signal may be sent to whole process group. */
+  signal(SIGUSR1, SIG_IGN);
+#endif
+
   /* Configuration. */
   terminated = 0;
 
@@ -228,6 +1152,15 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+  /* Binary is found by path, so that upgrade runs the file installed there now. */
+  ts_exec_argv = argv;
+  ts_exec_path = strchr(argv[0], '/') ? realpath(argv[0], NULL) : NULL;
+  if ( ts_exec_path == NULL )
+    ts_exec_path = argv[0];
+
+  pidfd = 0;
+  parent = ts_inherit(&pidfd);
+
   if ( !config->do_foreground && daemon(1, 0) ) {
     fprintf(stderr, "ERROR: Failed to daemonize, exiting: %m.\n");
     exit(EXIT_FAILURE);
@@ -235,16 +1168,20 @@ int main(int argc, char **argv) {
 
   openlog(PROGRAM_NAME, config->log_option, LOG_DAEMON);
 
-  /* Open lockfile. */
-  pidfd = 0;
+  /* Open lockfile, on upgrade it is inherited with its lock. */
+  if ( config->pidfile == NULL && pidfd > 0 ) {
+    close(pidfd);
+    pidfd = 0;
+  }
   if ( config->pidfile != NULL ) {
-    pidfd = open(config->pidfile, O_RDWR | O_CREAT, 0644);
+    if ( pidfd <= 0 )
+      pidfd = open(config->pidfile, O_RDWR | O_CREAT, 0644);
     if ( pidfd < 0 ) {
       syslog(LOG_ERR, "ERROR: Could not open PID file %s, exiting.", config->pidfile);
       exit(EXIT_FAILURE);
     }
-    /* Try to lock file. */
-    if ( lockf(pidfd, F_TLOCK, 0) < 0 ) {
+    /* Try to lock file, the lock belongs to open file and passes to upgraded server. */
+    if ( flock(pidfd, LOCK_EX | LOCK_NB) < 0 ) {
       syslog(LOG_ERR, "ERROR: Could not lock PID file %s, exiting.", config->pidfile);
       exit(EXIT_FAILURE);
     }
@@ -252,7 +1189,8 @@ int main(int argc, char **argv) {
 
   if ( pidfd > 0 ) {
     sprintf(pid, "%d\n", getpid());
-    write(pidfd, pid, strlen(pid));
+    if ( ftruncate(pidfd, 0) < 0 || pwrite(pidfd, pid, strlen(pid), 0) < 0 )
+      syslog(LOG_WARNING, "Cannot write PID file %s: %m.", config->pidfile);
   }
 
   /* Handle things for changing user. */
@@ -269,18 +1207,74 @@ int main(int argc, char **argv) {
     }
   }
 
+  /* Threads are never added, caps and rates are split among -w workers only. */
+  if ( config->threads && config->max_workers > config->workers ) {
+    syslog(LOG_WARNING, "Workers run as threads, -W %u is ignored.", config->max_workers);
+    config->max_workers = config->workers;
+  }
+
+  workers = malloc(config->max_workers * sizeof(ts_worker_t));
+  if ( workers == NULL ) {
+    syslog(LOG_ERR, "ERROR: Cannot allocate workers, exiting.");
+    exit(EXIT_FAILURE);
+  }
+  for ( index = 0; index < config->max_workers; index++ ) {
+    workers[index].index = index;
+    workers[index].config = config;
+  }
+  ts_affinity_plan(config, workers);
+
+  if ( ts_bind(config, workers) < 0 ) {
+    syslog(LOG_CRIT, "Cannot bind to ports!");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Sockets are ours now, old server lets its workers finish their connections and exits. */
+  if ( parent > 0 ) {
+    syslog(LOG_INFO, "Taking over from server with PID %ld.", (long)parent);
+    kill(parent, SIGTERM);
+  }
+
+  if ( config->threads ) {
+    ts_stats_segment_create(config->stats_name, config->workers);
+    ts_threads_run(config, workers, pidfd);
+    ts_stats_segment_remove(config->stats_name);
+  }
+  else {
 #ifdef FORK
-  subprocess_init();
-  subprocess_add(&ts_main_loop, (void *)config);
-  subprocess_run();
-  subprocess_quit();
+    /* Workers write statistics to shared memory, without it each keeps its own. */
+    if ( ts_stats_segment_create(config->stats_name, config->max_workers) < 0 && config->max_workers > config->workers )
+      syslog(LOG_WARNING, "Without statistics segment the pool is not resized and stalled workers are not replaced.");
+
+    subprocess_init();
+    memset(&supervisor, 0, sizeof(supervisor));
+    supervisor.config = config;
+    supervisor.workers = workers;
+    supervisor.last_tick = ts_clock_ms();
+    supervisor.pidfd = pidfd;
+    for ( index = 0; index < config->workers; index++ )
+      ts_supervisor_start(&supervisor);
+
+    /* Workers push access log records to rings drained by separate writer process. */
+    if ( config->access_log && ts_log_init(config->max_workers, config->log_sample) == 0 )
+      subprocess_add(&ts_log_writer_loop, (void *)config);
+    subprocess_run(ts_supervisor_tick, (void *)&supervisor, TS_SUPERVISOR_TICK);
+    subprocess_quit();
+
+    ts_stats_segment_remove(config->stats_name);
 #else
-  ts_main_loop((void *)config);
+    if ( config->access_log )
+      syslog(LOG_WARNING, "Access log requires writer process, it is disabled.");
+    ts_main_loop((void *)&workers[0]);
 #endif
+  }
+
+  free(workers);
 
   if ( pidfd > 0 ) {
+    if ( ts_pidfile_owned(pidfd) )
+      unlink(config->pidfile);
     close(pidfd);
-    unlink(config->pidfile);
   }
 
   ts_configuration_free(config);